@@ -0,0 +1,197 @@
+/*
+ * Sorted block table implementation
+ *
+ * Each chunk holds between one and BTAB_CHUNK keys in order and every
+ * key of a chunk is smaller than the first key of the next one. A full
+ * chunk is split in two, an emptied chunk is dropped and a chunk that
+ * falls below a quarter full is merged with its successor when both fit
+ * in half a chunk, so chunks stay dense and the first keys stay short.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "btab.h"
+
+static chunk_t *new_chunk(btab_t *tab);
+static void add_chunk(btab_t *tab, size_t c, chunk_t *chunk);
+static void drop_chunk(btab_t *tab, size_t c);
+static long find_chunk(const btab_t *tab, bkey_t key);
+static int find_slot(const chunk_t *chunk, bkey_t key);
+
+btab_t *btab_new() {
+    btab_t *tab = calloc(1, sizeof(btab_t));
+    if (!tab) {
+        fprintf(stderr, "ERROR.  Couldn't create block table\n");
+        exit(1);
+    }
+    return tab;
+}
+
+void btab_free(btab_t *tab) {
+    for (size_t c = 0; c < tab->num_chunks; c++)
+        free(tab->chunks[c]);
+    free(tab->spare);
+    free(tab->firsts);
+    free(tab->chunks);
+    free(tab);
+}
+
+bool btab_insert(btab_t *tab, bkey_t key, void *record) {
+    if (tab->num_chunks == 0)
+        add_chunk(tab, 0, new_chunk(tab));
+
+    /* A key below every first key goes to the front of the first chunk */
+    long found = find_chunk(tab, key);
+    size_t c = found < 0 ? 0 : (size_t) found;
+    chunk_t *chunk = tab->chunks[c];
+    int j = find_slot(chunk, key);
+    if (j > 0 && chunk->keys[j - 1] == key)
+        /* Already have key in table */
+        return false;
+
+    if (chunk->count == BTAB_CHUNK) {
+        /* Move the upper half to a new chunk after this one */
+        chunk_t *upper = new_chunk(tab);
+        int half = BTAB_CHUNK / 2;
+        upper->count = BTAB_CHUNK - half;
+        memcpy(upper->keys, chunk->keys + half, upper->count * sizeof(bkey_t));
+        memcpy(upper->records, chunk->records + half, upper->count * sizeof(void *));
+        chunk->count = half;
+        add_chunk(tab, c + 1, upper);
+        tab->firsts[c + 1] = upper->keys[0];
+        if (j > half) {
+            chunk = upper;
+            j -= half;
+            c++;
+        }
+    }
+
+    memmove(chunk->keys + j + 1, chunk->keys + j, (chunk->count - j) * sizeof(bkey_t));
+    memmove(chunk->records + j + 1, chunk->records + j,
+            (chunk->count - j) * sizeof(void *));
+    chunk->keys[j] = key;
+    chunk->records[j] = record;
+    chunk->count++;
+    tab->firsts[c] = chunk->keys[0];
+    tab->node_count++;
+    return true;
+}
+
+void *btab_find_nearest(btab_t *tab, bkey_t key) {
+    long c = find_chunk(tab, key);
+    if (c < 0)
+        return NULL;
+    chunk_t *chunk = tab->chunks[c];
+    /* The first key of the chunk is <= key, so the slot is at least 1 */
+    return chunk->records[find_slot(chunk, key) - 1];
+}
+
+void *btab_remove(btab_t *tab, bkey_t key) {
+    long found = find_chunk(tab, key);
+    if (found < 0)
+        return NULL;
+    size_t c = (size_t) found;
+    chunk_t *chunk = tab->chunks[c];
+    int j = find_slot(chunk, key) - 1;
+    if (chunk->keys[j] != key)
+        return NULL;
+
+    void *r = chunk->records[j];
+    chunk->count--;
+    memmove(chunk->keys + j, chunk->keys + j + 1, (chunk->count - j) * sizeof(bkey_t));
+    memmove(chunk->records + j, chunk->records + j + 1,
+            (chunk->count - j) * sizeof(void *));
+    tab->node_count--;
+
+    if (chunk->count == 0) {
+        drop_chunk(tab, c);
+        return r;
+    }
+    tab->firsts[c] = chunk->keys[0];
+
+    if (chunk->count < BTAB_CHUNK / 4 && c + 1 < tab->num_chunks) {
+        chunk_t *next = tab->chunks[c + 1];
+        if (chunk->count + next->count <= BTAB_CHUNK / 2) {
+            memcpy(chunk->keys + chunk->count, next->keys, next->count * sizeof(bkey_t));
+            memcpy(chunk->records + chunk->count, next->records,
+                   next->count * sizeof(void *));
+            chunk->count += next->count;
+            drop_chunk(tab, c + 1);
+        }
+    }
+    return r;
+}
+
+/*** Helper functions ***/
+
+static chunk_t *new_chunk(btab_t *tab) {
+    chunk_t *chunk = tab->spare;
+    if (chunk) {
+        tab->spare = NULL;
+    } else if (!(chunk = malloc(sizeof(chunk_t)))) {
+        fprintf(stderr, "ERROR.  Couldn't create block table chunk\n");
+        exit(1);
+    }
+    chunk->count = 0;
+    return chunk;
+}
+
+/* Insert chunk at position c, its first key is set by the caller */
+static void add_chunk(btab_t *tab, size_t c, chunk_t *chunk) {
+    if (tab->num_chunks == tab->max_chunks) {
+        size_t max = tab->max_chunks ? 2 * tab->max_chunks : 16;
+        bkey_t *firsts = realloc(tab->firsts, max * sizeof(bkey_t));
+        chunk_t **chunks = firsts ? realloc(tab->chunks, max * sizeof(chunk_t *)) : NULL;
+        if (!chunks) {
+            fprintf(stderr, "ERROR.  Couldn't grow block table\n");
+            exit(1);
+        }
+        tab->firsts = firsts;
+        tab->chunks = chunks;
+        tab->max_chunks = max;
+    }
+    size_t n = tab->num_chunks - c;
+    memmove(tab->firsts + c + 1, tab->firsts + c, n * sizeof(bkey_t));
+    memmove(tab->chunks + c + 1, tab->chunks + c, n * sizeof(chunk_t *));
+    tab->chunks[c] = chunk;
+    tab->num_chunks++;
+}
+
+/* Take the chunk at position c out of the table and keep it as the spare */
+static void drop_chunk(btab_t *tab, size_t c) {
+    chunk_t *chunk = tab->chunks[c];
+    size_t n = tab->num_chunks - c - 1;
+    memmove(tab->firsts + c, tab->firsts + c + 1, n * sizeof(bkey_t));
+    memmove(tab->chunks + c, tab->chunks + c + 1, n * sizeof(chunk_t *));
+    tab->num_chunks--;
+    free(tab->spare);
+    tab->spare = chunk;
+}
+
+/* Position of the last chunk whose first key is <= key, or -1 */
+static long find_chunk(const btab_t *tab, bkey_t key) {
+    size_t lo = 0, hi = tab->num_chunks;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (tab->firsts[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (long) lo - 1;
+}
+
+/* Position of the first key of chunk that is > key */
+static int find_slot(const chunk_t *chunk, bkey_t key) {
+    int lo = 0, hi = chunk->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (chunk->keys[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
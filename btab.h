@@ -0,0 +1,38 @@
+/*
+ * Sorted block table, an ordered map with the same use as the splay
+ * tree in stree.h but laid out for predecessor queries: the keys live in
+ * sorted chunks of BTAB_CHUNK entries, and a search is a binary search
+ * over the first key of each chunk followed by one inside the chunk.
+ */
+
+typedef long bkey_t;
+
+#define BTAB_CHUNK 64
+
+typedef struct {
+    int count;
+    bkey_t keys[BTAB_CHUNK];
+    void *records[BTAB_CHUNK];
+} chunk_t;
+
+typedef struct {
+    bkey_t *firsts;     // first key of each chunk, in order
+    chunk_t **chunks;
+    size_t num_chunks;
+    size_t max_chunks;  // allocated length of firsts and chunks
+    chunk_t *spare;     // an emptied chunk kept for the next split
+    size_t node_count;
+} btab_t;
+
+btab_t *btab_new();
+
+/* Delete the table, the records are left to the caller */
+void btab_free(btab_t *tab);
+
+/* Insertion function returns false if already have key in table */
+bool btab_insert(btab_t *tab, bkey_t key, void *record);
+
+/* Find element with largest key <= given key */
+void *btab_find_nearest(btab_t *tab, bkey_t key);
+
+void *btab_remove(btab_t *tab, bkey_t key);
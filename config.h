@@ -27,6 +27,8 @@
   "syn-string-short.rep", \
   "syn-mix-short.rep", \
   "syn-largemem-short.rep", \
+  "syn-batch-short.rep", \
+  "syn-arena-short.rep", \
   "ngram-fox1.rep", \
   "syn-mix-realloc.rep", \
   "bdd-aa4.rep", \
@@ -38,6 +40,7 @@
   "cbit-satadd.rep", \
   "cbit-xyz.rep", \
   "ngram-gulliver1.rep", \
+  "ngram-gulliver1-arena.rep", \
   "ngram-gulliver2.rep", \
   "ngram-moby1.rep", \
   "ngram-shake1.rep", \
@@ -112,9 +115,12 @@
 #define MAXFILL        1024
 
 /*
- * Alignment requirement in bytes (either 4, 8, or 16)
+ * Alignment requirement in bytes, a power of 2 from 16 to 256 chosen with
+ * make ALIGNMENT=<n>; mm.c builds its blocks to the same value
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 16
+#endif
 
 /*********** Parameters controlling dense memory version of heap ***********/
 /*
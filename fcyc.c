@@ -1,7 +1,14 @@
 /* Compute time used by function f */
 #include <stdlib.h>
+#include <string.h>
 #include <sys/times.h>
 #include <stdio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 #include "clock.h"
 #include "fcyc.h"
@@ -10,7 +17,8 @@
 #define MAXSAMPLES 20
 #define EPSILON 0.01 
 #define CLEAR_CACHE 0
-#define CACHE_BYTES (1<<19)
+#define CACHE_BYTES 0       /* sized from the last level cache */
+#define CACHE_DEFAULT (1<<19)
 #define CACHE_BLOCK 32
 #define MIN_TICKS 1000
 #define MIN_REPS 8
@@ -27,6 +35,10 @@ static double min_time = 0;
 
 static long int *cache_buf = NULL;
 
+/* Hardware counters read around each sample of fsec, -1 if not open */
+static int counter_fds[FCYC_EVENTS] = { -1, -1, -1, -1, -1 };
+static double counts[FCYC_EVENTS];      /* per call, in the fastest sample */
+
 static double *values = NULL;
 static long int samplecount = 0;
 
@@ -95,11 +107,46 @@ static long int has_converged()
 
 static volatile long int sink = 0;
 
+/*
+ * Size of the largest cache of the machine, read from sysconf or from
+ * sysfs where sysconf does not know it
+ */
+static long int llc_bytes()
+{
+    long int bytes = 0;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    bytes = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (bytes <= 0)
+	bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+    for (int i = 0; bytes <= 0 && i < 8; i++) {
+	char name[64];
+	snprintf(name, sizeof(name),
+		 "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+	FILE *f = fopen(name, "r");
+	if (!f)
+	    continue;
+	long int size;
+	char unit = 'K';
+	if (fscanf(f, "%ld%c", &size, &unit) >= 1) {
+	    size <<= unit == 'M' ? 20 : unit == 'K' ? 10 : 0;
+	    if (size > bytes)
+		bytes = size;
+	}
+	fclose(f);
+    }
+    return bytes > 0 ? bytes : CACHE_DEFAULT;
+}
+
 static void clear()
 {
     long int x = sink;
     long int *cptr, *cend;
     long int incr = cache_block/sizeof(long int);
+    if (cache_bytes == 0) {
+	/* Sweep twice the cache so none of the timed data survives */
+	cache_bytes = 2 * llc_bytes();
+    }
     if (!cache_buf) {
 	cache_buf = malloc(cache_bytes);
 	if (!cache_buf) {
@@ -156,9 +203,60 @@ double fcyc(test_funct f, void *args)
     return result;  
 }
 
+#ifdef __linux__
+static int open_counter(__u32 type, __u64 config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+			   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+#endif
+
+/* Start all open counters from zero */
+static void start_counters()
+{
+#ifdef __linux__
+    for (int e = 0; e < FCYC_EVENTS; e++) {
+	if (counter_fds[e] >= 0) {
+	    ioctl(counter_fds[e], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(counter_fds[e], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+#endif
+}
+
+/* Stop the counters and read them into sample, per call of reps */
+static void stop_counters(double *sample, long reps)
+{
+    for (int e = 0; e < FCYC_EVENTS; e++) {
+	long long value;
+	sample[e] = -1;
+#ifdef __linux__
+	if (counter_fds[e] < 0)
+	    continue;
+	ioctl(counter_fds[e], PERF_EVENT_IOC_DISABLE, 0);
+	if (read(counter_fds[e], &value, sizeof(value)) == sizeof(value))
+	    sample[e] = (double) value / reps;
+#else
+	(void) value;
+	(void) reps;
+#endif
+    }
+}
+
 double fsec(test_funct f, void *args)
 {
     double result;
+    double sample[FCYC_EVENTS];
     /* Increase reps until get meaningful times */
     long reps = min_reps;
     long r;
@@ -181,14 +279,20 @@ double fsec(test_funct f, void *args)
     do {
 	if (clear_cache)
 	    clear();
+	start_counters();
 	start_timer();
 	for (r = 0; r < reps; r++) {
 	    f(args);
 	}
 	sec = get_timer()/reps;
+	stop_counters(sample, reps);
 	//	printf(" %.3f", sec * 1e6);
-	if (sec > 0.0)
+	if (sec > 0.0) {
 	    add_sample(sec);
+	    /* Keep the counts of the fastest sample, the one reported */
+	    if (sec == values[0])
+		memcpy(counts, sample, sizeof(counts));
+	}
     } while (!has_converged() && samplecount < maxsamples);
     result = values[0];
     //    printf(" --> %.3f\n", result * 1e6);
@@ -223,7 +327,7 @@ void set_fcyc_clear_cache(int clear)
 }
 
 /* Set size of cache to use when clearing cache 
-   Default = 1<<19 (512KB)
+   Default = 0, twice the size of the last level cache
 */
 void set_fcyc_cache_size(long int bytes)
 {
@@ -243,6 +347,46 @@ void set_fcyc_cache_block(long int bytes) {
     cache_block = bytes;
 }
 
+/* When set, fsec reads the hardware counters around each sample.
+   Returns the number of counters that could be opened.
+   Default = 0
+*/
+int set_fcyc_counters(int on)
+{
+    int opened = 0;
+    for (int e = 0; e < FCYC_EVENTS; e++) {
+	if (counter_fds[e] >= 0)
+	    close(counter_fds[e]);
+	counter_fds[e] = -1;
+    }
+#ifdef __linux__
+    if (on) {
+	counter_fds[FCYC_CYCLES] =
+	    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	counter_fds[FCYC_INSTRUCTIONS] =
+	    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+	counter_fds[FCYC_L1D_MISSES] =
+	    open_counter(PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D));
+	counter_fds[FCYC_LLC_MISSES] =
+	    open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	counter_fds[FCYC_DTLB_MISSES] =
+	    open_counter(PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB));
+    }
+#endif
+    for (int e = 0; e < FCYC_EVENTS; e++) {
+	counts[e] = -1;
+	opened += counter_fds[e] >= 0;
+    }
+    return opened;
+}
+
+/* Counts per call of f in the fastest sample of the last fsec, -1 for
+   a counter that is not open */
+void get_fcyc_counters(double *counts_out)
+{
+    memcpy(counts_out, counts, sizeof(counts));
+}
+
 /* Value of K in K-best
    Default = 3
 */
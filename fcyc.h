@@ -14,6 +14,10 @@ double fcyc(test_funct f, void* args);
 /* Compute number of cycles used by function f on given set of parameters */
 double fsec(test_funct f, void* args);
 
+/* Hardware events that fsec can count */
+enum { FCYC_CYCLES, FCYC_INSTRUCTIONS, FCYC_L1D_MISSES, FCYC_LLC_MISSES,
+       FCYC_DTLB_MISSES, FCYC_EVENTS };
+
 /***********************************************************/
 /* Set the various parameters used by measurement routines */
 
@@ -29,7 +33,7 @@ void set_fcyc_min_reps(int r);
 void set_fcyc_clear_cache(int clear);
 
 /* Set size of cache to use when clearing cache 
-   Default = 1<<19 (512KB)
+   Default = 0, twice the size of the last level cache
 */
 void set_fcyc_cache_size(long int bytes);
 
@@ -43,6 +47,16 @@ void set_fcyc_cache_block(long int bytes);
 */
 void set_fcyc_compensate(long int compensate);
 
+/* When set, fsec reads the hardware counters around each sample.
+   Returns the number of counters that could be opened.
+   Default = 0
+*/
+int set_fcyc_counters(int on);
+
+/* Counts per call of f in the fastest sample of the last fsec, -1 for
+   a counter that is not open */
+void get_fcyc_counters(double *counts);
+
 /* Value of K in K-best
    Default = 3
 */
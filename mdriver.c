@@ -7,6 +7,7 @@
  * Copyright (c) 2004-2016, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE                 /* for sched_getcpu and sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
@@ -20,12 +21,24 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <math.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sched.h>
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
 #include "fcyc.h"
+#include "clock.h"
 #include "config.h"
 #include "stree.h"
+#include "btab.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -40,6 +53,20 @@
 #define REF_ONLY 0
 #endif
 
+/* Free lists that -G proposes size classes for, as in mm.c */
+#define CLASS_LISTS      43       /* lists below the tree of large blocks */
+#define CLASS_TREE       65536    /* smallest block kept in the tree */
+#define CLASS_SMALL      512      /* larger requests are served from the lists... */
+#define CLASS_HUGE       (1<<20)  /* ... and smaller ones */
+#define CLASS_UNIT       16       /* width of a histogram bucket in bytes */
+#define CLASS_BUCKETS    (CLASS_TREE / CLASS_UNIT)
+
+/* Benchmark mode (-b) */
+#define BENCH_Z          1.96     /* normal quantile of the 95% confidence intervals */
+#define BENCH_ALPHA      0.05     /* significance level of a regression */
+#define BENCH_MIN_CHANGE 0.01     /* smaller changes of a median are not flagged */
+#define CLASS_SCAN_BYTES 1024     /* passing a block in a list costs as much as this much slack */
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
@@ -71,20 +98,18 @@ typedef struct range_t {
 
 /*
  * All information about set of ranges represented as doubly-linked
- * list of ranges, plus a splay tree keyed by lo addresses
+ * list of ranges, plus a splay tree (or with -B a block table) keyed by
+ * lo addresses. The range of each block is kept in an arena indexed by
+ * its trace index, so checking a request allocates nothing.
  */
 typedef struct {
     range_t *list;
     tree_t *lo_tree;
+    btab_t *lo_table;
+    range_t *arena;        /* one range per index of the trace */
+    int num_ids;           /* length of arena */
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
-    long index;                         /* index for free() to use later */
-    size_t size;                        /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file */
 typedef struct {
     char filename[MAXLINE];
@@ -93,6 +118,8 @@ typedef struct {
     int num_ops;          /* number of distinct requests */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
+    void *map;            /* mapping of a binary trace that holds ops... */
+    size_t map_len;       /* ... and its length, or NULL and 0 */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     int *block_rand_base; /* index into random_data, if debug is on */
@@ -107,6 +134,41 @@ typedef struct {
     trace_t *trace;
 } speed_t;
 
+/*
+ * Latencies of one request type in cycles, bucketed by their highest
+ * set bit and LAT_SUB bits below it
+ */
+#define LAT_SUB_BITS 2
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+typedef struct {
+    size_t count[LAT_BUCKETS];
+    size_t n;               /* number of requests timed */
+    double max;             /* slowest request, exact */
+} histogram_t;
+
+/* One of the slowest requests of a trace */
+typedef struct {
+    double cycles;
+    int opnum;
+    int type;               /* ALLOC, FREE, REALLOC or a batch */
+} slow_op_t;
+
+/* Per-request timing of a trace, collected with -L */
+typedef struct {
+    histogram_t hist[NUM_OP_TYPES]; /* indexed by request type */
+    slow_op_t *slowest;     /* num_slowest slowest requests, slowest first */
+    int num_slow;
+    double *cycles;         /* every request in trace order, only with -b */
+} latency_t;
+
+/* Samples of one trace in benchmark mode, one per run (-b) */
+typedef struct {
+    int cpu;                /* the CPU the runs were pinned to, or -1 */
+    double *kops;           /* throughput */
+    double *util;           /* space utilization */
+    double *p99;            /* 99th percentile of all request latencies, in cycles */
+} bench_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* set in read_trace */
@@ -120,10 +182,55 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;       /* space utilization for this trace (always 0 for libc) */
+    latency_t *latency; /* per-request timing, only with -L */
+    size_t peak_heap;   /* largest heap size during the trace */
+    size_t end_heap;    /* heap size once the trace is done */
+    size_t end_resident; /* heap bytes backed by memory once the trace is done */
+    int peak_op;        /* request after which the most payload was allocated */
+    struct mm_stats *alloc; /* allocator statistics at peak_op, only with -S */
+    double counters[FCYC_EVENTS]; /* hardware events per request, only with -P */
+    bench_t *bench;     /* samples of every run, only with -b */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+#ifdef MM_THREADS
+/*
+ * Blocks that one replay thread hands to the next one to free.
+ * Single producer, single consumer ring; head and tail only grow.
+ */
+#define HANDOFF_LEN 1024
+typedef struct {
+    char *blocks[HANDOFF_LEN];
+    size_t head;            /* next block the consumer frees */
+    size_t tail;            /* next slot the producer fills */
+} handoff_t;
+
+/* Holds the state of one thread of the -j replay */
+typedef struct {
+    trace_t *trace;             /* shared, read only */
+    char **blocks;              /* this thread's own block table */
+    size_t *sizes;              /* and the requested sizes, kept with -z */
+    handoff_t *inbox;           /* blocks freed for the previous thread */
+    handoff_t *outbox;          /* the next thread's inbox */
+    pthread_barrier_t *barrier; /* releases all threads at once */
+    struct timespec start, end; /* when this thread started and finished the trace */
+    bool failed;                /* the heap ran out of memory */
+} replay_t;
+#endif
+
+/* What a worker process of -p sends back for one trace */
+typedef struct {
+    int index;          /* which trace */
+    bool valid;
+    int errors;         /* errors the worker found */
+    double util;
+    size_t peak_heap;
+    size_t end_heap;
+    size_t end_resident;
+    int peak_op;
+} result_t;
+
 /* Summarizes the key statistics for a set of traces */
 typedef struct {
     double util;  /* average utilization expressed as a percentage */
@@ -161,6 +268,29 @@ static bool onetime_flag = false;
 static bool tab_mode = false;     /* Print output as tab-separated fields */
 static size_t maxfill = MAXFILL;
 
+/* by default, requests are not timed one by one (set by -L and -W) */
+static bool latency_mode = false;
+static bool memory_mode = false;    /* print heap and resident bytes (set by -r) */
+static bool alloc_stats_mode = false; /* print allocator statistics (set by -S) */
+static int frag_interval = 0;       /* write a fragmentation timeline every n requests (set by -F) */
+static bool block_table = false;    /* look up ranges in a btab_t (set by -B) */
+static bool counters_mode = false;  /* print hardware events per request (set by -P) */
+static bool sized_free = false;     /* free with mm_free_sized (set by -z) */
+static int num_slowest = 0;
+static char *classes_file = NULL;   /* write proposed size classes here (set by -G) */
+
+/* by default, each trace is timed once (set by -b) */
+static int bench_runs = 0;
+static char *bench_file = NULL;     /* write the benchmark samples here as JSON (set by -o) */
+static char *baseline_file = NULL;  /* compare the benchmark with these samples (set by -R) */
+
+/* by default, traces are replayed on a single thread (set by -j) */
+static int num_jobs = 0;
+static int cross_pct = 0;   /* percent of frees handed to another thread (-x) */
+
+/* by default, traces are checked one at a time (set by -p) */
+static int num_procs = 0;
+
 /* by default, no timeouts */
 static int set_timeout = 0;
 
@@ -206,8 +336,11 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static bool map_trace(trace_t *trace);
+static void parse_trace(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
+static char *arena_request(struct mm_arena **arena, size_t size);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static bool eval_libc_valid(trace_t *trace);
@@ -216,8 +349,23 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
-static double eval_mm_util(trace_t *trace, int tracenum);
+static bool eval_mm_huge(const trace_t *trace);
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static latency_t *eval_mm_latency(trace_t *trace);
+static void print_latency(int n, stats_t *stats);
+static bench_t *eval_mm_bench(trace_t *trace, int tracenum, stats_t *stats);
+static void print_bench(int n, stats_t *stats);
+static void write_bench(const char *file, int n, stats_t *stats);
+static int compare_bench(const char *file, int n, stats_t *stats);
+static void print_memory(int n, stats_t *stats);
+static struct mm_stats *eval_mm_stats(trace_t *trace, int stop);
+static void eval_mm_frag(trace_t *trace, int peak);
+static void print_alloc_stats(int n, stats_t *stats);
+static void eval_classes(const char *outfile);
+#ifdef MM_THREADS
+static void eval_mm_threads(int n, stats_t *stats);
+#endif
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
@@ -241,6 +389,166 @@ static void timeout_handler(int sig __attribute__((unused))) {
 /* Compute throughput from reference implementation */
 static double measure_ref_throughput();
 
+/*
+ * time_trace - time the speed function on a trace with fsec and, with
+ *              -P, keep the hardware events of the timed run per request
+ */
+static double time_trace(test_funct f, speed_t *speed_params, stats_t *stats)
+{
+    double secs = fsec(f, speed_params);
+    if (counters_mode) {
+        get_fcyc_counters(stats->counters);
+        for (int e = 0; e < FCYC_EVENTS; e++)
+            if (stats->counters[e] >= 0)
+                stats->counters[e] /= speed_params->trace->num_ops;
+    }
+    return secs;
+}
+
+/*
+ * eval_worker - run the correctness and utilization passes of one trace
+ *               in a fresh heap and write the result to fd
+ */
+static void eval_worker(int fd, int index, const char *tracedir, char *tracefile)
+{
+    stats_t stats;
+    result_t result;
+
+    memset(&stats, 0, sizeof(stats));
+    memset(&result, 0, sizeof(result));
+    mem_init();
+    range_set_t *ranges = new_range_set();
+    trace_t *trace = read_trace(&stats, tracedir, tracefile);
+
+    result.index = index;
+    result.valid = eval_mm_valid(trace, ranges) && eval_mm_valid(trace, ranges);
+    if (result.valid) {
+        result.util = eval_mm_util(trace, index, &stats);
+        result.peak_heap = stats.peak_heap;
+        result.end_heap = stats.end_heap;
+        result.end_resident = stats.end_resident;
+        result.peak_op = stats.peak_op;
+    }
+    result.errors = errors;
+    _exit(write(fd, &result, sizeof(result)) == sizeof(result) ? 0 : 1);
+}
+
+/*
+ * run_workers - check the traces on up to num_procs processes at once,
+ *               one process per trace. A trace whose worker crashes or
+ *               times out is not valid.
+ */
+static void run_workers(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, result_t *results)
+{
+    int fds[2];
+    pid_t *pids = calloc(num_tracefiles, sizeof(pid_t));
+    volatile int next = 0, running = 0;
+
+    if (pids == NULL)
+        unix_error("pids calloc in run_workers failed");
+    if (pipe(fds) < 0)
+        unix_error("pipe in run_workers failed");
+
+    /* Results are smaller than PIPE_BUF, so the workers' writes do not mix */
+    if (setjmp(timeout_jmpbuf) != 0) {
+        for (int i = 0; i < next; i++)
+            if (pids[i] > 0)
+                kill(pids[i], SIGKILL);
+        while (wait(NULL) > 0)
+            ;
+        free(pids);
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    while (next < num_tracefiles || running > 0) {
+        if (next < num_tracefiles && running < num_procs) {
+            pid_t pid = fork();
+            if (pid < 0)
+                unix_error("fork in run_workers failed");
+            if (pid == 0) {
+                close(fds[0]);
+                eval_worker(fds[1], next, tracedir, tracefiles[next]);
+            }
+            pids[next++] = pid;
+            running++;
+            continue;
+        }
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            unix_error("wait in run_workers failed");
+        running--;
+        int i;
+        for (i = 0; pids[i] != pid; i++)
+            ;
+        pids[i] = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            /* The worker wrote its result before it exited */
+            result_t result;
+            if (read(fds[0], &result, sizeof(result)) != sizeof(result))
+                unix_error("read in run_workers failed");
+            results[result.index] = result;
+            errors += result.errors;
+        } else {
+            fprintf(stderr, "The worker for %s %s\n", tracefiles[i],
+                    WIFSIGNALED(status) ? strsignal(WTERMSIG(status)) : "failed");
+            errors++;
+        }
+    }
+    free(pids);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/*
+ * run_parallel - with -p, check all traces in parallel first, then time
+ *                the valid ones one after another so the timings do not
+ *                compete for the machine
+ */
+static void run_parallel(int num_tracefiles, const char *tracedir,
+                         char **tracefiles,
+                         stats_t *mm_stats, speed_t *speed_params) {
+    volatile int i;
+    result_t *results = calloc(num_tracefiles, sizeof(result_t));
+
+    if (results == NULL)
+        unix_error("results calloc in run_parallel failed");
+    run_workers(num_tracefiles, tracedir, tracefiles, results);
+
+    for (i=0; i < num_tracefiles; i++) {
+        mem_init();
+        trace_t *volatile trace;
+        trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
+        mm_stats[i].valid = results[i].valid;
+        mm_stats[i].util = results[i].util;
+        mm_stats[i].peak_heap = results[i].peak_heap;
+        mm_stats[i].end_heap = results[i].end_heap;
+        mm_stats[i].end_resident = results[i].end_resident;
+        mm_stats[i].peak_op = results[i].peak_op;
+
+        if (setjmp(timeout_jmpbuf) != 0) {
+            mm_stats[i].valid = false;
+        } else if (mm_stats[i].valid) {
+            speed_params->trace = trace;
+            mm_stats[i].secs = time_trace(eval_mm_speed, speed_params, &mm_stats[i]);
+            if (bench_runs > 0)
+                mm_stats[i].bench = eval_mm_bench(trace, i, &mm_stats[i]);
+            if (latency_mode)
+                mm_stats[i].latency = eval_mm_latency(trace);
+            if (alloc_stats_mode)
+                mm_stats[i].alloc = eval_mm_stats(trace, mm_stats[i].peak_op);
+            if (frag_interval > 0)
+                eval_mm_frag(trace, mm_stats[i].peak_op);
+        }
+        free_trace(trace);
+        mem_deinit();
+    }
+    free(results);
+}
+
 /*
  * Run the tests; return the number of tests run (may be less than
  * num_tracefiles, if there's a timeout)
@@ -254,12 +562,12 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         /* initialize simulated memory system in memlib.c *
          * start each trace with a clean system */
         mem_init();
-        range_set_t *ranges = new_range_set();
+        range_set_t *volatile ranges = new_range_set();
 
 
         // NOTE: If times out, then it will reread the trace file 
 
-        trace_t *trace;
+        trace_t *volatile trace;
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
         strcpy(mm_stats[i].filename, trace->filename);
         mm_stats[i].ops = trace->num_ops;
@@ -282,11 +590,19 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         if (mm_stats[i].valid) {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].util = eval_mm_util(trace, i, &mm_stats[i]);
             speed_params->trace = trace;
             if (verbose > 1)
                 printf("and performance.\n");
-            mm_stats[i].secs = fsec(eval_mm_speed, speed_params);
+            mm_stats[i].secs = time_trace(eval_mm_speed, speed_params, &mm_stats[i]);
+            if (bench_runs > 0)
+                mm_stats[i].bench = eval_mm_bench(trace, i, &mm_stats[i]);
+            if (latency_mode)
+                mm_stats[i].latency = eval_mm_latency(trace);
+            if (alloc_stats_mode)
+                mm_stats[i].alloc = eval_mm_stats(trace, mm_stats[i].peak_op);
+            if (frag_interval > 0)
+                eval_mm_frag(trace, mm_stats[i].peak_op);
         }
 
 #if 0
@@ -356,7 +672,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hOVlDT")) != EOF) {
+    while ((c = getopt(argc, argv, "b:d:f:c:j:o:p:s:t:v:x:F:G:R:W:hOVlBCDLPrSTz")) != EOF) {
         switch (c) {
 
             case 'f': /* Use one specific trace file only (relative to curr dir) */
@@ -406,6 +722,94 @@ int main(int argc, char **argv)
                 tab_mode = true;
                 break;
 
+            case 'j': /* Replay each trace on n threads at once */
+                num_jobs = atoi(optarg);
+#ifndef MM_THREADS
+                fprintf(stderr, "-j needs a driver built with MM_THREADS (make mdriver-mt)\n");
+                exit(1);
+#endif
+                break;
+
+            case 'p': /* Check the traces on n processes at once */
+                num_procs = atoi(optarg);
+                break;
+
+            case 'B': /* Look up ranges in a block table, not a splay tree */
+                block_table = true;
+                break;
+
+            case 'z': /* Pass the requested size to every free */
+                sized_free = true;
+                break;
+
+            case 'C': /* Time with a cold cache */
+                set_fcyc_clear_cache(1);
+                break;
+
+            case 'P': /* Count hardware events while timing */
+                counters_mode = true;
+                if (set_fcyc_counters(1) == 0)
+                    fprintf(stderr, "No hardware counters could be opened, "
+                            "check /proc/sys/kernel/perf_event_paranoid\n");
+                break;
+
+            case 'r': /* Print heap size and resident bytes of each trace */
+                memory_mode = true;
+                break;
+
+            case 'S': /* Print allocator statistics at the peak of each trace */
+#ifndef MM_STATS
+                fprintf(stderr, "-S needs a driver built with MM_STATS (make stats)\n");
+                exit(1);
+#endif
+                alloc_stats_mode = true;
+                break;
+
+            case 'F': /* Write a fragmentation timeline and a heap map of each trace */
+#ifndef MM_STATS
+                fprintf(stderr, "-F needs a driver built with MM_STATS (make stats)\n");
+                exit(1);
+#endif
+                frag_interval = atoi(optarg);
+                if (frag_interval < 1) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'L': /* Time every request and print latency percentiles */
+                latency_mode = true;
+                break;
+
+            case 'G': /* Write size classes fitted to the traces and exit */
+                classes_file = optarg;
+                break;
+
+            case 'W': /* Also list the n slowest requests of each trace */
+                latency_mode = true;
+                num_slowest = atoi(optarg);
+                break;
+
+            case 'b': /* Time each trace n times and report medians */
+                bench_runs = atoi(optarg);
+                if (bench_runs < 1) {
+                    usage(argv[0]);
+                    exit(1);
+                }
+                break;
+
+            case 'o': /* Write the samples of -b to a file */
+                bench_file = optarg;
+                break;
+
+            case 'R': /* Compare the samples of -b with a baseline */
+                baseline_file = optarg;
+                break;
+
+            case 'x': /* Percentage of frees done by another thread with -j */
+                cross_pct = atoi(optarg);
+                break;
+
             case 'h': /* Print this message */
                 usage(argv[0]);
                 exit(0);
@@ -423,6 +827,16 @@ int main(int argc, char **argv)
             add_tracefile(default_tracefiles[i]);
     }
 
+    if (classes_file != NULL) {
+        eval_classes(classes_file);
+        exit(0);
+    }
+
+    if ((bench_file != NULL || baseline_file != NULL) && bench_runs == 0) {
+        fprintf(stderr, "-o and -R need -b\n");
+        exit(1);
+    }
+
     if (debug_mode != DBG_NONE) {
         init_random_data();
     }
@@ -456,7 +870,8 @@ int main(int argc, char **argv)
                 speed_params.trace = trace;
                 if (verbose > 1)
                     printf("and performance.\n");
-                libc_stats[i].secs = fsec(eval_libc_speed, &speed_params);
+                libc_stats[i].secs = time_trace(eval_libc_speed, &speed_params,
+                                                &libc_stats[i]);
             }
             free_trace(trace);
         }
@@ -500,8 +915,12 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
-              &speed_params);
+    if (num_procs > 0 && !onetime_flag)
+        run_parallel(num_global_tracefiles, tracedir, global_tracefiles,
+                     mm_stats, &speed_params);
+    else
+        run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
+                  &speed_params);
 
 
     /* Display the mm results in a compact table */
@@ -518,9 +937,32 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (memory_mode)
+                print_memory(num_global_tracefiles, mm_stats);
+            if (latency_mode)
+                print_latency(num_global_tracefiles, mm_stats);
+            if (alloc_stats_mode)
+                print_alloc_stats(num_global_tracefiles, mm_stats);
+            if (bench_runs > 0)
+                print_bench(num_global_tracefiles, mm_stats);
         }
     }
 
+    /* Optionally keep the benchmark and hold it against a baseline */
+    int regressions = 0;
+    if (bench_runs > 0 && !onetime_flag) {
+        if (bench_file != NULL)
+            write_bench(bench_file, num_global_tracefiles, mm_stats);
+        if (baseline_file != NULL)
+            regressions = compare_bench(baseline_file, num_global_tracefiles, mm_stats);
+    }
+
+#ifdef MM_THREADS
+    /* Optionally measure mm under contention */
+    if (num_jobs > 0 && !onetime_flag)
+        eval_mm_threads(num_global_tracefiles, mm_stats);
+#endif
+
     /* Optionally compare the performance of mm and libc */
     if (run_libc) {
         printf("Comparison with libc malloc: mm/libc = %.0f Kops / %.0f Kops = %.2f\n", 
@@ -662,7 +1104,7 @@ int main(int argc, char **argv)
            (int)ceil(points_final), (int)POINTS_FINAL);
 #endif
 
-    exit(0);
+    exit(regressions > 0 ? 2 : 0);
 }
 
 
@@ -688,8 +1130,13 @@ static void add_tracefile(char *trace) {
  */
 static range_set_t *new_range_set() {
     range_set_t *ranges = (range_set_t *) malloc(sizeof(range_set_t));
+    if (ranges == NULL)
+        unix_error("malloc error in new_range_set");
     ranges->list = NULL;
-    ranges->lo_tree = tree_new();
+    ranges->lo_tree = block_table ? NULL : tree_new();
+    ranges->lo_table = block_table ? btab_new() : NULL;
+    ranges->arena = NULL;
+    ranges->num_ids = 0;
     return ranges;
 }
 
@@ -712,9 +1159,11 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap or of a region
+       mapped with mm_mmap */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_region(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -726,7 +1175,9 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     if (debug_mode == DBG_NONE) return 1;
 
     /* Look in the tree for the predecessor block */
-    range_t *prev = tree_find_nearest(ranges->lo_tree, (long unsigned) lo);
+    range_t *prev = block_table ?
+        btab_find_nearest(ranges->lo_table, (long unsigned) lo) :
+        tree_find_nearest(ranges->lo_tree, (long unsigned) lo);
     range_t *next = prev ? prev->next : NULL;
     /* See if it overlaps previous or next blocks */
     if (prev && lo <= prev->hi) {
@@ -743,11 +1194,9 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     }
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * in the range of its index and add it the range list.
      */
-    range_t *p;
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
+    range_t *p = &ranges->arena[index];
     p->prev = prev;
     if (prev)
         prev->next = p;
@@ -759,16 +1208,21 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     p->lo = lo;
     p->hi = hi;
     p->index = index;
-    tree_insert(ranges->lo_tree, (long unsigned) lo, (void *) p);
+    if (block_table)
+        btab_insert(ranges->lo_table, (long unsigned) lo, (void *) p);
+    else
+        tree_insert(ranges->lo_tree, (long unsigned) lo, (void *) p);
     return true;
 }
 
 /*
- * remove_range - Free the range record of block whose payload starts at lo
+ * remove_range - Drop the range record of block whose payload starts at lo
  */
 static void remove_range(range_set_t *ranges, char *lo)
 {
-    range_t *p = (range_t *) tree_remove(ranges->lo_tree, (long unsigned) lo);
+    range_t *p = block_table ?
+        (range_t *) btab_remove(ranges->lo_table, (long unsigned) lo) :
+        (range_t *) tree_remove(ranges->lo_tree, (long unsigned) lo);
     if (!p)
         return;
     range_t *prev = p->prev;
@@ -779,17 +1233,28 @@ static void remove_range(range_set_t *ranges, char *lo)
         ranges->list = next;
     if (next)
         next->prev = prev;
-    free(p);
 }
 
 /*
- * reset_range_set - reset all the range records
+ * reset_range_set - reset all the range records, making room for the
+ *                   num_ids indexes of the next trace
  */
-static void reset_range_set(range_set_t *ranges)
+static void reset_range_set(range_set_t *ranges, int num_ids)
 {
-    tree_free(ranges->lo_tree, free);
-    ranges->lo_tree = tree_new();
+    if (block_table) {
+        btab_free(ranges->lo_table);
+        ranges->lo_table = btab_new();
+    } else {
+        tree_free(ranges->lo_tree, NULL);
+        ranges->lo_tree = tree_new();
+    }
     ranges->list = NULL;
+    if (num_ids > ranges->num_ids) {
+        free(ranges->arena);
+        if ((ranges->arena = malloc(num_ids * sizeof(range_t))) == NULL)
+            unix_error("malloc error in reset_range_set");
+        ranges->num_ids = num_ids;
+    }
 }
 
 /*
@@ -797,7 +1262,11 @@ static void reset_range_set(range_set_t *ranges)
  */
 static void free_range_set(range_set_t *ranges)
 {
-    tree_free(ranges->lo_tree, free);
+    if (block_table)
+        btab_free(ranges->lo_table);
+    else
+        tree_free(ranges->lo_tree, NULL);
+    free(ranges->arena);
     free(ranges);
 }
 
@@ -924,30 +1393,61 @@ static bool check_index(const trace_t *trace, int opnum, int index, int realloc)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * map_trace - if trace->filename is a binary trace, fill in the header
+ *    fields of trace and map its records as trace->ops. Returns false,
+ *    leaving trace alone, if the file does not start with TRACE_MAGIC.
  */
-static trace_t *read_trace(stats_t *stats, const char *tracedir,
-                           const char *filename)
+static bool map_trace(trace_t *trace)
+{
+    trace_header_t hdr;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(trace->filename, O_RDONLY)) < 0)
+        unix_error("Could not open %s in read_trace", trace->filename);
+    if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0) {
+        close(fd);
+        return false;
+    }
+    if (fstat(fd, &st) < 0)
+        unix_error("Could not stat %s in read_trace", trace->filename);
+    if (hdr.num_ops > INT_MAX || hdr.num_ids < 0 ||
+        (size_t) st.st_size != sizeof(hdr) + hdr.num_ops * sizeof(traceop_t))
+        app_error("%s: binary trace is truncated or was written on "
+                  "another kind of machine\n", trace->filename);
+
+    trace->weight = hdr.weight;
+    trace->num_ids = hdr.num_ids;
+    trace->num_ops = (int) hdr.num_ops;
+    trace->data_bytes = hdr.data_bytes;
+
+    /* The records are used in place, the pages are read on first use */
+    trace->map_len = st.st_size;
+    trace->map = mmap(NULL, trace->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (trace->map == MAP_FAILED)
+        unix_error("mmap of %s failed in read_trace", trace->filename);
+    close(fd);
+    trace->ops = (traceop_t *) ((char *) trace->map + sizeof(hdr));
+    return true;
+}
+
+/*
+ * parse_trace - read the header and the requests of the .rep file
+ *    trace->filename into trace
+ */
+static void parse_trace(trace_t *trace)
 {
     FILE *tracefile;
-    trace_t *trace;
     char type[MAXLINE];
     int index;
     size_t size;
     int max_index = 0;
     int op_index;
+    int count;
+    int epoch = 0;      /* first request since the last arena reset */
     int ignore = 0;
 
-    if (verbose > 1)
-        printf("Reading tracefile: %s\n", filename);
-
-    /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-        unix_error("malloc 1 failed in read_trace");
-
-    /* Read the trace file header */
-    strcpy(trace->filename, tracedir);
-    strcat(trace->filename, filename);
     if ((tracefile = fopen(trace->filename, "r")) == NULL) {
         unix_error("Could not open %s in read_trace", trace->filename);
     }
@@ -958,31 +1458,11 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     ignore +=  fscanf(tracefile, "%d", &trace->num_ops);
     ignore +=  fscanf(tracefile, "%zd", &trace->data_bytes);
 
-    if (((unsigned int)trace->weight) > 3u) {
-        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
-    }
-
     /* We'll store each request line in the trace in this array */
     if ((trace->ops =
          (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
         unix_error("malloc 2 failed in read_trace");
 
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks =
-         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
-        unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes =
-         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
-        unix_error("malloc 4 failed in read_trace");
-
-    /* and, if we're debugging, the offset into the random data */
-    if ((trace->block_rand_base =
-         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-        unix_error("malloc 5 failed in read_trace");
-
-
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
@@ -1007,6 +1487,34 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
                 trace->ops[op_index].type = FREE;
                 trace->ops[op_index].index = index;
                 break;
+            case 'A':
+            case 'F':
+                ignore += fscanf(tracefile, "%u %u", &index, &count);
+                if (type[0] == 'A')
+                    ignore += fscanf(tracefile, "%lu", &size);
+                else
+                    size = 0;
+                if (count < 1)
+                    app_error("Empty batch in tracefile %s\n", trace->filename);
+                trace->ops[op_index].type = type[0] == 'A' ? ALLOC_BATCH : FREE_BATCH;
+                trace->ops[op_index].count = count;
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].size = size;
+                max_index = (index + count - 1 > max_index) ? index + count - 1 : max_index;
+                break;
+            case 'n':
+                ignore += fscanf(tracefile, "%u %lu", &index, &size);
+                trace->ops[op_index].type = ARENA_ALLOC;
+                trace->ops[op_index].index = index;
+                trace->ops[op_index].size = size;
+                max_index = (index > max_index) ? index : max_index;
+                break;
+            case 'N':
+                trace->ops[op_index].type = ARENA_RESET;
+                trace->ops[op_index].index = epoch;
+                trace->ops[op_index].size = 0;
+                epoch = op_index + 1;
+                break;
             default:
                 app_error("Bogus type character (%c) in tracefile %s\n",
                           type[0], trace->filename);
@@ -1017,6 +1525,50 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
+}
+
+/*
+ * read_trace - read a trace file and store it in memory, or map it if
+ *    it is a binary trace made by rep2bin
+ */
+static trace_t *read_trace(stats_t *stats, const char *tracedir,
+                           const char *filename)
+{
+    trace_t *trace;
+
+    if (verbose > 1)
+        printf("Reading tracefile: %s\n", filename);
+
+    /* Allocate the trace record */
+    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
+        unix_error("malloc 1 failed in read_trace");
+
+    /* Read the trace file, binary traces are ready once mapped */
+    strcpy(trace->filename, tracedir);
+    strcat(trace->filename, filename);
+    trace->map = NULL;
+    trace->map_len = 0;
+    if (!map_trace(trace))
+        parse_trace(trace);
+
+    if (((unsigned int)trace->weight) > 3u) {
+        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+    }
+
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks =
+         (char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes =
+         (size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in read_trace");
+
+    /* and, if we're debugging, the offset into the random data */
+    if ((trace->block_rand_base =
+         calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+        unix_error("malloc 5 failed in read_trace");
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
@@ -1038,49 +1590,101 @@ static void reinit_trace(trace_t *trace)
 
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated or mapped in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map != NULL)   /* unmap or free the requests... */
+        munmap(trace->map, trace->map_len);
+    else
+        free(trace->ops);
+    /* ... and the three arrays */
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
     free(trace);              /* and the trace record itself... */
 }
 
+/*
+ * arena_request - bump allocate size bytes from *arena, which is made
+ *    on the first arena request of a replay. Returns NULL on failure.
+ */
+static char *arena_request(struct mm_arena **arena, size_t size)
+{
+    if (*arena == NULL && (*arena = mm_arena_create()) == NULL)
+        return NULL;
+    return mm_arena_alloc(*arena, size);
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * eval_mm_huge - check that requests bigger than any heap fail, rather
+ *    than wrap around in the size arithmetic of the allocator. Called on
+ *    a fresh heap, before the requests of the trace.
+ */
+static bool eval_mm_huge(const trace_t *trace)
+{
+    char *p;
+
+    if (mm_malloc(SIZE_MAX) != NULL) {
+        malloc_error(trace, 0, "mm_malloc(SIZE_MAX) did not fail.");
+        return false;
+    }
+    if (mm_calloc(1, SIZE_MAX - 100) != NULL) {
+        malloc_error(trace, 0, "mm_calloc(1, SIZE_MAX-100) did not fail.");
+        return false;
+    }
+    if (mm_calloc(SIZE_MAX / 2, 4) != NULL) {
+        malloc_error(trace, 0, "mm_calloc(SIZE_MAX/2, 4) did not fail.");
+        return false;
+    }
+    if ((p = mm_malloc(3000)) == NULL) {
+        malloc_error(trace, 0, "mm_malloc failed.");
+        return false;
+    }
+    if (mm_realloc(p, SIZE_MAX - 3) != NULL) {
+        malloc_error(trace, 0, "mm_realloc(p, SIZE_MAX-3) did not fail.");
+        return false;
+    }
+    mm_free(p);
+    return true;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
-    int index;
+    int i, j;
+    int index, count;
     size_t size;
     char *newp;
     char *oldp;
     char *p;
+    struct mm_arena *arena = NULL;
 
     /* Reset the heap and free any records in the range list */
     mem_reset_brk();
     reinit_trace(trace);
-    reset_range_set(ranges);
+    reset_range_set(ranges, trace->num_ids);
 
     /* Call the mm package's init function */
     if (!mm_init()) {
         malloc_error(trace, 0, "mm_init failed.");
         return false;
     }
+    if (!eval_mm_huge(trace))
+        return false;
 
     /* Interpret each operation in the trace in order */
     for (i = 0;  i < trace->num_ops;  i++) {
         index = trace->ops[i].index;
         size = trace->ops[i].size;
+        count = trace->ops[i].count;
 
         if (debug_mode == DBG_EXPENSIVE) {
             range_t *r;
@@ -1180,33 +1784,87 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                     p = trace->blocks[index];
                     remove_range(ranges, p);
                 }
-                mm_free(p);
+                if (sized_free && p != NULL)
+                    mm_free_sized(p, trace->block_sizes[index]);
+                else
+                    mm_free(p);
                 break;
 
-            default:
-                app_error("Nonexistent request type in eval_mm_valid");
-        }
-    }
-    /* As far as we know, this is a valid malloc package */
-    return true;
-}
-
-/*
- * eval_mm_util - Evaluate the space utilization of the student's package
- *   The idea is to remember the high water mark "hwm" of the heap for
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                if (mm_malloc_batch(size, count, (void **) &trace->blocks[index]) != (size_t) count) {
+                    malloc_error(trace, i, "mm_malloc_batch failed.");
+                    return false;
+                }
+                for (j = index; j < index + count; j++) {
+                    if (add_range(ranges, trace->blocks[j], size, trace, i, j) == 0)
+                        return false;
+                    trace->block_sizes[j] = size;
+                    randomize_block(trace, j);
+                }
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                for (j = index; j < index + count; j++) {
+                    if (!check_index(trace, i, j, 0))
+                        return false;
+                    remove_range(ranges, trace->blocks[j]);
+                }
+                /* The batch call sorts the pointers, the blocks are gone anyway */
+                mm_free_batch((void **) &trace->blocks[index], count);
+                break;
+
+            case ARENA_ALLOC: /* mm_arena_alloc */
+                if ((p = arena_request(&arena, size)) == NULL) {
+                    malloc_error(trace, i, "mm_arena_alloc failed.");
+                    return false;
+                }
+                if (add_range(ranges, p, size, trace, i, index) == 0)
+                    return false;
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                randomize_block(trace, index);
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                /* Every arena object since the last reset must be intact */
+                for (j = index; j < i; j++) {
+                    if (trace->ops[j].type != ARENA_ALLOC)
+                        continue;
+                    if (!check_index(trace, i, trace->ops[j].index, 0))
+                        return false;
+                    remove_range(ranges, trace->blocks[trace->ops[j].index]);
+                    trace->blocks[trace->ops[j].index] = NULL;
+                }
+                if (arena != NULL)
+                    mm_arena_reset(arena);
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_valid");
+        }
+    }
+    if (arena != NULL)
+        mm_arena_destroy(arena);
+    /* As far as we know, this is a valid malloc package */
+    return true;
+}
+
+/*
+ * eval_mm_util - Evaluate the space utilization of the student's package
+ *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace. mem_sbrk() can decrement the brk pointer,
+ *   so the largest heap size seen after any request is used. The
+ *   final heap size and resident bytes are recorded in stats.
  *
  *   A higher number is better: 1 is optimal.
  */
-static double eval_mm_util(trace_t *trace, int tracenum)
+static double eval_mm_util(trace_t *trace, int tracenum, stats_t *stats)
 {
-    int i;
-    int index;
+    int i, j;
+    int index, count;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
@@ -1214,11 +1872,14 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     size_t heap_size = 0;
     char *p;
     char *newp, *oldp;
+    struct mm_arena *arena = NULL;
 
     reinit_trace(trace);
 
-    /* initialize the heap and the mm malloc package */
+    /* initialize the heap and the mm malloc package, no page is
+       resident until the allocator touches it */
     mem_reset_brk();
+    mem_release();
     if (!mm_init())
         app_error("trace %d: mm_init failed in eval_mm_util", tracenum);
 
@@ -1274,15 +1935,58 @@ static double eval_mm_util(trace_t *trace, int tracenum)
                 total_size -= size;
                 break;
 
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                index = trace->ops[i].index;
+                count = trace->ops[i].count;
+                size = trace->ops[i].size;
+                if (mm_malloc_batch(size, count, (void **) &trace->blocks[index]) != (size_t) count)
+                    app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                              tracenum);
+                for (j = index; j < index + count; j++)
+                    trace->block_sizes[j] = size;
+                total_size += count * size;
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                index = trace->ops[i].index;
+                count = trace->ops[i].count;
+                for (j = index; j < index + count; j++)
+                    total_size -= trace->block_sizes[j];
+                mm_free_batch((void **) &trace->blocks[index], count);
+                break;
+
+            case ARENA_ALLOC: /* mm_arena_alloc */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                if ((p = arena_request(&arena, size)) == NULL)
+                    app_error("trace %d: mm_arena_alloc failed in eval_mm_util",
+                              tracenum);
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                total_size += size;
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                for (j = trace->ops[i].index; j < i; j++) {
+                    if (trace->ops[j].type == ARENA_ALLOC)
+                        total_size -= trace->block_sizes[trace->ops[j].index];
+                }
+                if (arena != NULL)
+                    mm_arena_reset(arena);
+                break;
+
             default:
                 app_error("trace %d: Nonexistent request type in eval_mm_util",
                           tracenum);
         }
 
         /* update the high-water mark */
-        max_total_size = (total_size > max_total_size) ?
-            total_size : max_total_size;
-        heap_size = mem_heapsize();
+        if (total_size > max_total_size) {
+            max_total_size = total_size;
+            stats->peak_op = i;
+        }
+        /* mapped regions count as heap for as long as they exist */
+        heap_size = mem_heapsize() + mem_mapped();
         max_heap_size = (heap_size > max_heap_size) ?
             heap_size : max_heap_size;
     }
@@ -1291,6 +1995,11 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     printf(".");
 #endif
 
+    stats->peak_heap = max_heap_size;
+    stats->end_heap = mem_heapsize() + mem_mapped();
+    stats->end_resident = mem_resident();
+    if (arena != NULL)
+        mm_arena_destroy(arena);
     return ((double)max_total_size / (double)max_heap_size);
 }
 
@@ -1301,9 +2010,10 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
+    int i, j, index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
+    struct mm_arena *arena = NULL;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
@@ -1322,6 +2032,7 @@ static void eval_mm_speed(void *ptr)
                 if ((p = mm_malloc(size)) == NULL)
                     app_error("mm_malloc error in eval_mm_speed");
                 trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
                 break;
 
             case REALLOC: /* mm_realloc */
@@ -1331,6 +2042,7 @@ static void eval_mm_speed(void *ptr)
                 if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
                     app_error("mm_realloc error in eval_mm_speed");
                 trace->blocks[index] = newp;
+                trace->block_sizes[index] = newsize;
                 break;
 
             case FREE: /* mm_free */
@@ -1340,12 +2052,1248 @@ static void eval_mm_speed(void *ptr)
                 } else {
                     block = trace->blocks[index];
                 }
-                mm_free(block);
+                if (sized_free && block != NULL)
+                    mm_free_sized(block, trace->block_sizes[index]);
+                else
+                    mm_free(block);
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                index = trace->ops[i].index;
+                size = trace->ops[i].size;
+                if (mm_malloc_batch(size, trace->ops[i].count,
+                                    (void **) &trace->blocks[index]) != (size_t) trace->ops[i].count)
+                    app_error("mm_malloc_batch error in eval_mm_speed");
+                for (j = index; sized_free && j < index + trace->ops[i].count; j++)
+                    trace->block_sizes[j] = size;
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                index = trace->ops[i].index;
+                mm_free_batch((void **) &trace->blocks[index], trace->ops[i].count);
+                break;
+
+            case ARENA_ALLOC: /* mm_arena_alloc */
+                index = trace->ops[i].index;
+                if ((p = arena_request(&arena, trace->ops[i].size)) == NULL)
+                    app_error("mm_arena_alloc error in eval_mm_speed");
+                trace->blocks[index] = p;
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                if (arena != NULL)
+                    mm_arena_reset(arena);
                 break;
 
             default:
                 app_error("Nonexistent request type in eval_mm_speed");
         }
+    if (arena != NULL)
+        mm_arena_destroy(arena);
+}
+
+#ifdef MM_THREADS
+/*
+ * handoff_free - free block on the consumer's side of the ring.
+ *    Returns false if the ring is full and the caller must free it.
+ */
+static bool handoff_free(handoff_t *ring, char *block)
+{
+    size_t tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == HANDOFF_LEN)
+        return false;
+    ring->blocks[tail % HANDOFF_LEN] = block;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * handoff_drain - free every block another thread handed to us
+ */
+static void handoff_drain(handoff_t *ring)
+{
+    size_t head = ring->head;
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++)
+        mm_free(ring->blocks[head % HANDOFF_LEN]);
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * replay_thread - replay one copy of the trace with a private block
+ *    table, so the copies have disjoint id spaces. With -x, some frees
+ *    are done by the next thread instead.
+ */
+static void *replay_thread(void *arg)
+{
+    replay_t *r = (replay_t *)arg;
+    trace_t *trace = r->trace;
+    int i, index, nfree = 0;
+    char *p;
+    struct mm_arena *arena = NULL;
+
+    pthread_barrier_wait(r->barrier);
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    for (i = 0;  i < trace->num_ops && !r->failed;  i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+
+            case ALLOC: /* mm_malloc */
+                /* N copies of a trace may need more memory than the heap has */
+                if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+                    r->failed = true;
+                r->blocks[index] = p;
+                if (r->sizes != NULL)
+                    r->sizes[index] = trace->ops[i].size;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                p = mm_realloc(r->blocks[index], trace->ops[i].size);
+                if (p == NULL && trace->ops[i].size != 0)
+                    r->failed = true;
+                else
+                    r->blocks[index] = p;
+                if (r->sizes != NULL)
+                    r->sizes[index] = trace->ops[i].size;
+                break;
+
+            case FREE: /* mm_free, handed off blocks lose their size */
+                handoff_drain(r->inbox);
+                p = index < 0 ? NULL : r->blocks[index];
+                if (p != NULL && nfree++ % 100 < cross_pct
+                    && handoff_free(r->outbox, p))
+                    break;
+                if (r->sizes != NULL && p != NULL)
+                    mm_free_sized(p, r->sizes[index]);
+                else
+                    mm_free(p);
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                if (mm_malloc_batch(trace->ops[i].size, trace->ops[i].count,
+                                    (void **) &r->blocks[index]) != (size_t) trace->ops[i].count)
+                    r->failed = true;
+                for (int k = index; r->sizes != NULL && k < index + trace->ops[i].count; k++)
+                    r->sizes[k] = trace->ops[i].size;
+                break;
+
+            case FREE_BATCH: /* mm_free_batch, never handed to another thread */
+                handoff_drain(r->inbox);
+                mm_free_batch((void **) &r->blocks[index], trace->ops[i].count);
+                break;
+
+            case ARENA_ALLOC: /* mm_arena_alloc, each thread has its own arena */
+                if ((p = arena_request(&arena, trace->ops[i].size)) == NULL)
+                    r->failed = true;
+                r->blocks[index] = p;
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                if (arena != NULL)
+                    mm_arena_reset(arena);
+                break;
+
+            default:
+                app_error("Nonexistent request type in replay_thread");
+        }
+    }
+    if (arena != NULL)
+        mm_arena_destroy(arena);
+    clock_gettime(CLOCK_MONOTONIC, &r->end);
+
+    /* Blocks still in the ring are freed once every thread is done */
+    pthread_barrier_wait(r->barrier);
+    handoff_drain(r->inbox);
+    return NULL;
+}
+
+/*
+ * eval_mm_threads - replay every valid trace on num_jobs threads
+ *    sharing one heap and print per-thread and aggregate throughput.
+ */
+static void eval_mm_threads(int n, stats_t *stats)
+{
+    int i, j;
+    double sumops = 0, sumsecs = 0;
+    pthread_t *tids = calloc(num_jobs, sizeof(pthread_t));
+    replay_t *replays = calloc(num_jobs, sizeof(replay_t));
+    handoff_t *rings = calloc(num_jobs, sizeof(handoff_t));
+    pthread_barrier_t barrier;
+
+    if (tids == NULL || replays == NULL || rings == NULL)
+        unix_error("calloc in eval_mm_threads failed");
+
+    printf("Results for mm malloc on %d threads, %d%% of frees cross threads:\n",
+           num_jobs, cross_pct);
+    printf("  %8s%8s%8s%10s  %s\n", "ops", "Kops", "min", "max", "trace");
+    for (i = 0; i < n; i++) {
+        stats_t tstats;
+        double first = DBL_MAX, last = 0, minkops = DBL_MAX, maxkops = 0;
+        bool failed = false;
+
+        if (!stats[i].valid)
+            continue;
+        trace_t *trace = read_trace(&tstats, tracedir, global_tracefiles[i]);
+
+        mem_init();
+        if (!mm_init())
+            app_error("mm_init failed in eval_mm_threads");
+        memset(rings, 0, num_jobs * sizeof(handoff_t));
+        pthread_barrier_init(&barrier, NULL, num_jobs);
+        for (j = 0; j < num_jobs; j++) {
+            replays[j].trace = trace;
+            replays[j].blocks = calloc(trace->num_ids, sizeof(char *));
+            replays[j].sizes = sized_free ? calloc(trace->num_ids, sizeof(size_t)) : NULL;
+            if (replays[j].blocks == NULL || (sized_free && replays[j].sizes == NULL))
+                unix_error("calloc in eval_mm_threads failed");
+            replays[j].inbox = &rings[j];
+            replays[j].outbox = &rings[(j + 1) % num_jobs];
+            replays[j].barrier = &barrier;
+            replays[j].failed = false;
+            if (pthread_create(&tids[j], NULL, replay_thread, &replays[j]) != 0)
+                unix_error("pthread_create in eval_mm_threads failed");
+        }
+        for (j = 0; j < num_jobs; j++) {
+            pthread_join(tids[j], NULL);
+            free(replays[j].blocks);
+            free(replays[j].sizes);
+            failed |= replays[j].failed;
+            double start = replays[j].start.tv_sec + replays[j].start.tv_nsec * 1e-9;
+            double end = replays[j].end.tv_sec + replays[j].end.tv_nsec * 1e-9;
+            double kops = trace->num_ops * 1e-3 / (end - start);
+            if (verbose > 1)
+                printf("    thread %d: %.0f Kops\n", j, kops);
+            minkops = kops < minkops ? kops : minkops;
+            maxkops = kops > maxkops ? kops : maxkops;
+            first = start < first ? start : first;
+            last = end > last ? end : last;
+        }
+        pthread_barrier_destroy(&barrier);
+        mem_deinit();
+
+        /* Aggregate throughput counts from the first start to the last finish */
+        double ops = (double)trace->num_ops * num_jobs;
+        double wall = last - first;
+        if (failed) {
+            printf("  %8s%8s%8s%10s  %s (out of memory)\n",
+                   "-", "-", "-", "-", trace->filename);
+            free_trace(trace);
+            continue;
+        }
+        printf("  %8.0f%8.0f%8.0f%10.0f  %s\n",
+               ops, ops * 1e-3 / wall, minkops, maxkops, trace->filename);
+        sumops += ops;
+        sumsecs += wall;
+        free_trace(trace);
+    }
+    printf("  %8.0f%8.0f\n\n", sumops, sumsecs == 0 ? 0 : sumops * 1e-3 / sumsecs);
+
+    free(tids);
+    free(replays);
+    free(rings);
+}
+#endif
+
+/*
+ * lat_bucket - bucket of a latency, lat_bound - the latency at which
+ *    a bucket ends
+ */
+static int lat_bucket(double cycles)
+{
+    uint64_t c = cycles < 1 ? 1 : (uint64_t)cycles;
+    int fl = 63 - __builtin_clzll(c);
+    int sl = (int)(fl >= LAT_SUB_BITS ? c >> (fl - LAT_SUB_BITS) : c << (LAT_SUB_BITS - fl));
+    return (fl << LAT_SUB_BITS) + (sl & ((1 << LAT_SUB_BITS) - 1));
+}
+
+static double lat_bound(int bucket)
+{
+    int fl = bucket >> LAT_SUB_BITS;
+    int sl = bucket & ((1 << LAT_SUB_BITS) - 1);
+    return ldexp((1 << LAT_SUB_BITS) + sl + 1, fl - LAT_SUB_BITS);
+}
+
+/*
+ * lat_percentile - upper bound of the bucket holding the pct percentile,
+ *    capped by the exact maximum
+ */
+static double lat_percentile(const histogram_t *hist, double pct)
+{
+    size_t rank = (size_t)ceil(hist->n * pct / 100.0);
+    size_t seen = 0;
+    int i;
+    for (i = 0; i < LAT_BUCKETS; i++) {
+        seen += hist->count[i];
+        if (seen >= rank && seen > 0)
+            break;
+    }
+    double bound = i < LAT_BUCKETS ? lat_bound(i) : hist->max;
+    return bound < hist->max ? bound : hist->max;
+}
+
+/*
+ * eval_mm_latency - Replay the trace once more, timing every request
+ *    with the cycle counter. The counter costs a little on each request,
+ *    so the figures are for comparing tails, not for adding up.
+ */
+static latency_t *eval_mm_latency(trace_t *trace)
+{
+    int i, j, index;
+    size_t size;
+    char *p, *block;
+    double cycles;
+    struct mm_arena *arena = NULL;
+    latency_t *lat = calloc(1, sizeof(latency_t));
+    if (lat == NULL)
+        unix_error("calloc in eval_mm_latency failed");
+    if (num_slowest > 0) {
+        lat->slowest = calloc(num_slowest, sizeof(slow_op_t));
+        if (lat->slowest == NULL)
+            unix_error("calloc in eval_mm_latency failed");
+    }
+    if (bench_runs > 0) {
+        lat->cycles = malloc(trace->num_ops * sizeof(double));
+        if (lat->cycles == NULL)
+            unix_error("malloc in eval_mm_latency failed");
+    }
+    reinit_trace(trace);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_latency");
+
+    mhz(verbose > 1);
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+
+            case ALLOC: /* mm_malloc */
+                start_counter();
+                p = mm_malloc(size);
+                cycles = get_counter();
+                if (p == NULL)
+                    app_error("mm_malloc error in eval_mm_latency");
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                block = trace->blocks[index];
+                start_counter();
+                p = mm_realloc(block, size);
+                cycles = get_counter();
+                if (p == NULL && size != 0)
+                    app_error("mm_realloc error in eval_mm_latency");
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                break;
+
+            case FREE: /* mm_free */
+                block = index < 0 ? NULL : trace->blocks[index];
+                start_counter();
+                if (sized_free && block != NULL)
+                    mm_free_sized(block, trace->block_sizes[index]);
+                else
+                    mm_free(block);
+                cycles = get_counter();
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch, timed as one request */
+                start_counter();
+                j = mm_malloc_batch(size, trace->ops[i].count, (void **) &trace->blocks[index]);
+                cycles = get_counter();
+                if (j != trace->ops[i].count)
+                    app_error("mm_malloc_batch error in eval_mm_latency");
+                for (j = index; sized_free && j < index + trace->ops[i].count; j++)
+                    trace->block_sizes[j] = size;
+                break;
+
+            case FREE_BATCH: /* mm_free_batch, timed as one request */
+                start_counter();
+                mm_free_batch((void **) &trace->blocks[index], trace->ops[i].count);
+                cycles = get_counter();
+                break;
+
+            case ARENA_ALLOC: /* mm_arena_alloc, the first one makes the arena */
+                start_counter();
+                p = arena_request(&arena, size);
+                cycles = get_counter();
+                if (p == NULL)
+                    app_error("mm_arena_alloc error in eval_mm_latency");
+                trace->blocks[index] = p;
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                start_counter();
+                if (arena != NULL)
+                    mm_arena_reset(arena);
+                cycles = get_counter();
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_latency");
+        }
+
+        histogram_t *hist = &lat->hist[trace->ops[i].type];
+        int bucket = lat_bucket(cycles);
+        hist->count[bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1]++;
+        hist->n++;
+        hist->max = cycles > hist->max ? cycles : hist->max;
+        if (lat->cycles != NULL)
+            lat->cycles[i] = cycles;
+
+        /* Keep the slowest requests sorted by insertion */
+        if (num_slowest > 0 && (lat->num_slow < num_slowest
+                                || cycles > lat->slowest[num_slowest-1].cycles)) {
+            j = lat->num_slow < num_slowest ? lat->num_slow++ : num_slowest - 1;
+            for (; j > 0 && lat->slowest[j-1].cycles < cycles; j--)
+                lat->slowest[j] = lat->slowest[j-1];
+            lat->slowest[j].cycles = cycles;
+            lat->slowest[j].opnum = i;
+            lat->slowest[j].type = trace->ops[i].type;
+        }
+    }
+    if (arena != NULL)
+        mm_arena_destroy(arena);
+    return lat;
+}
+
+/*
+ * print_latency - print the percentiles of every trace timed with -L
+ *    and free the timings
+ */
+static void print_latency(int n, stats_t *stats)
+{
+    static const char *names[] = { "malloc", "free", "realloc", "mbatch", "fbatch",
+                                   "arena", "reset" };
+    int i, t;
+
+    printf("Latency in cycles:\n");
+    printf("  %-8s%9s%9s%9s%9s%11s  %s\n",
+           "request", "ops", "p50", "p99", "p99.9", "max", "trace");
+    for (i = 0; i < n; i++) {
+        latency_t *lat = stats[i].latency;
+        if (lat == NULL)
+            continue;
+        for (t = 0; t < NUM_OP_TYPES; t++) {
+            histogram_t *hist = &lat->hist[t];
+            if (hist->n == 0)
+                continue;
+            printf("  %-8s%9zu%9.0f%9.0f%9.0f%11.0f  %s\n", names[t], hist->n,
+                   lat_percentile(hist, 50), lat_percentile(hist, 99),
+                   lat_percentile(hist, 99.9), hist->max, stats[i].filename);
+        }
+        for (t = 0; t < lat->num_slow; t++) {
+            printf("      line %d: %s took %.0f cycles\n",
+                   LINENUM(lat->slowest[t].opnum),
+                   names[lat->slowest[t].type],
+                   lat->slowest[t].cycles);
+        }
+        free(lat->slowest);
+        free(lat->cycles);
+        free(lat);
+        stats[i].latency = NULL;
+    }
+    printf("\n");
+}
+
+/*
+ * cmp_double - order doubles for qsort
+ */
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * median_ci - median of n samples and the order statistics that bound
+ *    the 95% confidence interval of the median, which holds whatever the
+ *    distribution of the samples
+ */
+static double median_ci(const double *x, int n, double *lo, double *hi)
+{
+    double *sorted = malloc(n * sizeof(double));
+    if (sorted == NULL)
+        unix_error("malloc in median_ci failed");
+    memcpy(sorted, x, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), cmp_double);
+
+    /* Ranks from 1 */
+    int l = (int) floor((n - BENCH_Z * sqrt(n)) / 2);
+    int u = (int) ceil(1 + (n + BENCH_Z * sqrt(n)) / 2);
+    *lo = sorted[l < 1 ? 0 : l - 1];
+    *hi = sorted[u > n ? n - 1 : u - 1];
+    double median = n % 2 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    free(sorted);
+    return median;
+}
+
+/*
+ * rank_test - one-sided Mann-Whitney test that the n samples y tend to
+ *    be smaller than the m samples x. Returns the p-value of the normal
+ *    approximation with a correction for ties and for continuity, 1 if
+ *    all samples are equal.
+ */
+static double rank_test(const double *x, int m, const double *y, int n)
+{
+    int N = m + n;
+    int i, j;
+    double u = 0, ties = 0;
+    double *all = malloc(N * sizeof(double));
+    if (all == NULL)
+        unix_error("malloc in rank_test failed");
+
+    for (i = 0; i < m; i++)
+        for (j = 0; j < n; j++)
+            u += y[j] < x[i] ? 1 : y[j] == x[i] ? 0.5 : 0;
+
+    /* Each group of t equal samples takes t^3-t from the variance of u */
+    memcpy(all, x, m * sizeof(double));
+    memcpy(all + m, y, n * sizeof(double));
+    qsort(all, N, sizeof(double), cmp_double);
+    for (i = 0; i < N; i = j) {
+        for (j = i + 1; j < N && all[j] == all[i]; j++)
+            ;
+        ties += pow(j - i, 3) - (j - i);
+    }
+    free(all);
+
+    /* Without rounding, all samples equal would give a variance of exactly 0 */
+    double var = m * n / 12.0 * ((N + 1) - ties / ((double) N * (N - 1)));
+    if (var < 1e-9)
+        return 1;
+    double z = (u - m * n / 2.0 - 0.5) / sqrt(var);
+    return 0.5 * erfc(z / sqrt(2));
+}
+
+/*
+ * eval_mm_bench - with -b, measure the utilization, throughput and p99
+ *    latency of a trace bench_runs more times, after the run of the
+ *    results table has warmed up the caches. The runs are pinned to the
+ *    CPU they start on, so they share one core and its caches, and stats
+ *    is left with the medians.
+ */
+static bench_t *eval_mm_bench(trace_t *trace, int tracenum, stats_t *stats)
+{
+    speed_t speed_params;
+    cpu_set_t cpus, pinned;
+    double lo, hi;
+    int r;
+    bench_t *bench = malloc(sizeof(bench_t));
+
+    if (bench == NULL || (bench->kops = malloc(bench_runs * sizeof(double))) == NULL
+        || (bench->util = malloc(bench_runs * sizeof(double))) == NULL
+        || (bench->p99 = malloc(bench_runs * sizeof(double))) == NULL)
+        unix_error("malloc in eval_mm_bench failed");
+
+    /* The rest of the driver, -p workers and -j threads included, is not pinned */
+    bool restore = sched_getaffinity(0, sizeof(cpus), &cpus) == 0;
+    bench->cpu = sched_getcpu();
+    CPU_ZERO(&pinned);
+    if (bench->cpu >= 0)
+        CPU_SET(bench->cpu, &pinned);
+    if (bench->cpu < 0 || sched_setaffinity(0, sizeof(pinned), &pinned) < 0)
+        bench->cpu = -1;
+
+    speed_params.trace = trace;
+    for (r = 0; r < bench_runs; r++) {
+        bench->util[r] = eval_mm_util(trace, tracenum, stats);
+        bench->kops[r] = trace->num_ops / time_trace(eval_mm_speed, &speed_params, stats) / 1000.0;
+        latency_t *lat = eval_mm_latency(trace);
+        qsort(lat->cycles, trace->num_ops, sizeof(double), cmp_double);
+        bench->p99[r] = trace->num_ops > 0 ? lat->cycles[(int) ceil(trace->num_ops * 0.99) - 1] : 0;
+        free(lat->slowest);
+        free(lat->cycles);
+        free(lat);
+    }
+    if (bench->cpu >= 0 && restore)
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+
+    stats->util = median_ci(bench->util, bench_runs, &lo, &hi);
+    stats->secs = trace->num_ops / (median_ci(bench->kops, bench_runs, &lo, &hi) * 1000.0);
+    return bench;
+}
+
+/*
+ * print_bench - print the medians of every trace timed with -b and
+ *    their confidence intervals
+ */
+static void print_bench(int n, stats_t *stats)
+{
+    int i;
+    double m, lo, hi;
+
+    printf("Medians of %d runs with 95%% confidence intervals:\n", bench_runs);
+    printf("  %7s%28s%27s%22s  %s\n", "Kops", "util", "p99 cycles", "cpu", "trace");
+    for (i = 0; i < n; i++) {
+        bench_t *b = stats[i].bench;
+        if (b == NULL)
+            continue;
+        m = median_ci(b->kops, bench_runs, &lo, &hi);
+        printf("  %7.0f [%7.0f, %7.0f]", m, lo, hi);
+        m = median_ci(b->util, bench_runs, &lo, &hi);
+        printf("  %6.1f%% [%6.1f%%, %6.1f%%]", m * 100, lo * 100, hi * 100);
+        m = median_ci(b->p99, bench_runs, &lo, &hi);
+        printf("  %6.0f [%6.0f, %6.0f]", m, lo, hi);
+        printf("%5d  %s\n", b->cpu, stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * write_samples - write one array of samples of a JSON trace object
+ */
+static void write_samples(FILE *out, const char *key, const double *x)
+{
+    int r;
+    fprintf(out, ", \"%s\": [", key);
+    for (r = 0; r < bench_runs; r++)
+        fprintf(out, "%s%.9g", r ? ", " : "", x[r]);
+    fprintf(out, "]");
+}
+
+/*
+ * write_bench - write the samples of -b to file as JSON,
+ *    {"runs": k, "traces": [{"trace": name, "cpu": c, "kops": [...],
+ *    "util": [...], "p99": [...]}, ...]}, a baseline for -R
+ */
+static void write_bench(const char *file, int n, stats_t *stats)
+{
+    FILE *out;
+    int i;
+    const char *sep = "";
+
+    if ((out = fopen(file, "w")) == NULL)
+        unix_error("Could not open %s in write_bench", file);
+    fprintf(out, "{\n  \"runs\": %d,\n  \"traces\": [", bench_runs);
+    for (i = 0; i < n; i++) {
+        bench_t *b = stats[i].bench;
+        if (b == NULL)
+            continue;
+        fprintf(out, "%s\n    {\"trace\": \"%s\", \"cpu\": %d", sep, stats[i].filename, b->cpu);
+        write_samples(out, "kops", b->kops);
+        write_samples(out, "util", b->util);
+        write_samples(out, "p99", b->p99);
+        fprintf(out, "}");
+        sep = ",";
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+}
+
+/*
+ * read_samples - read the array key of the JSON trace object that starts
+ *    at obj and ends before end (NULL for the last one) into a new *x.
+ *    Returns the number of samples, 0 if there is no such array.
+ */
+static int read_samples(const char *obj, const char *end, const char *key, double **x)
+{
+    char pattern[64];
+    const char *p;
+    char *next;
+    int n = 0, max = 16;
+
+    *x = NULL;
+    snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+    if ((p = strstr(obj, pattern)) == NULL || (end != NULL && p >= end)
+        || (p = strchr(p, '[')) == NULL)
+        return 0;
+    if ((*x = malloc(max * sizeof(double))) == NULL)
+        unix_error("malloc in read_samples failed");
+    for (p++; ; p = next) {
+        p += strspn(p, " \t\r\n,");
+        double v = strtod(p, &next);
+        if (next == p)
+            break;
+        if (n == max && (*x = realloc(*x, (max *= 2) * sizeof(double))) == NULL)
+            unix_error("realloc in read_samples failed");
+        (*x)[n++] = v;
+    }
+    return n;
+}
+
+/*
+ * compare_bench - hold the samples of -b against the baseline in file,
+ *    written by -o on an earlier run. A metric regresses when a one-sided
+ *    rank test finds it worse at level BENCH_ALPHA and its median moved
+ *    by more than BENCH_MIN_CHANGE, improvements are found the same way.
+ *    Returns the number of regressions.
+ */
+static int compare_bench(const char *file, int n, stats_t *stats)
+{
+    static const char *keys[] = { "kops", "util", "p99" };
+    static const char *names[] = { "Kops", "util", "p99" };
+    char pattern[MAXLINE + 16];
+    struct stat st;
+    int i, k, regressions = 0, improvements = 0, compared = 0;
+    FILE *in = fopen(file, "r");
+
+    if (in == NULL || fstat(fileno(in), &st) < 0)
+        unix_error("Could not open %s in compare_bench", file);
+    char *buf = malloc(st.st_size + 1);
+    if (buf == NULL)
+        unix_error("malloc in compare_bench failed");
+    buf[fread(buf, 1, st.st_size, in)] = '\0';
+    fclose(in);
+
+    printf("Comparison with %s, one-sided rank test at %.0f%%:\n", file, BENCH_ALPHA * 100);
+    printf("  %-6s%12s%12s%9s%10s  %s\n", "metric", "baseline", "median", "change", "p", "trace");
+    for (i = 0; i < n; i++) {
+        bench_t *b = stats[i].bench;
+        if (b == NULL)
+            continue;
+        snprintf(pattern, sizeof(pattern), "\"trace\": \"%s\"", stats[i].filename);
+        const char *obj = strstr(buf, pattern);
+        if (obj == NULL) {
+            printf("  %-6s%12s%12s%9s%10s  %s\n", "-", "-", "-", "-", "-", stats[i].filename);
+            continue;
+        }
+        const char *end = strstr(obj + 1, "\"trace\":");
+        double *cur[] = { b->kops, b->util, b->p99 };
+        compared++;
+        for (k = 0; k < 3; k++) {
+            double *base, lo, hi;
+            int m = read_samples(obj, end, keys[k], &base);
+            if (m == 0)
+                continue;
+            double before = median_ci(base, m, &lo, &hi);
+            double after = median_ci(cur[k], bench_runs, &lo, &hi);
+            double change = before != 0 ? (after - before) / before : 0;
+
+            /* Throughput and utilization are worse when they fall, latency when it rises */
+            double worse = k < 2 ? rank_test(base, m, cur[k], bench_runs)
+                                 : rank_test(cur[k], bench_runs, base, m);
+            double better = k < 2 ? rank_test(cur[k], bench_runs, base, m)
+                                  : rank_test(base, m, cur[k], bench_runs);
+            const char *verdict = "";
+            if (fabs(change) > BENCH_MIN_CHANGE && worse < BENCH_ALPHA) {
+                verdict = "  regression";
+                regressions++;
+            } else if (fabs(change) > BENCH_MIN_CHANGE && better < BENCH_ALPHA) {
+                verdict = "  improvement";
+                improvements++;
+            }
+            if (*verdict != '\0' || verbose > 1)
+                printf("  %-6s%12.*f%12.*f%8.1f%%%10.4f  %s%s\n", names[k],
+                       k == 1 ? 4 : 0, before, k == 1 ? 4 : 0, after, change * 100,
+                       worse < better ? worse : better, stats[i].filename, verdict);
+            free(base);
+        }
+    }
+    printf("%d regressions and %d improvements in %d traces compared\n\n",
+           regressions, improvements, compared);
+    free(buf);
+    return regressions;
+}
+
+/*
+ * eval_mm_stats - Replay the trace up to and including request stop and
+ *    return the allocator statistics at that point
+ */
+static struct mm_stats *eval_mm_stats(trace_t *trace, int stop)
+{
+    int i, index;
+    size_t size;
+    char *p;
+    struct mm_arena *arena = NULL;
+    struct mm_stats *alloc = calloc(1, sizeof(struct mm_stats));
+    if (alloc == NULL)
+        unix_error("calloc in eval_mm_stats failed");
+    reinit_trace(trace);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_stats");
+
+    for (i = 0;  i <= stop && i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+
+            case ALLOC: /* mm_malloc */
+                if ((p = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc error in eval_mm_stats");
+                trace->blocks[index] = p;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                p = mm_realloc(trace->blocks[index], size);
+                if (p == NULL && size != 0)
+                    app_error("mm_realloc error in eval_mm_stats");
+                trace->blocks[index] = p;
+                break;
+
+            case FREE: /* mm_free */
+                mm_free(index < 0 ? NULL : trace->blocks[index]);
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                if (mm_malloc_batch(size, trace->ops[i].count, (void **) &trace->blocks[index])
+                    != (size_t) trace->ops[i].count)
+                    app_error("mm_malloc_batch error in eval_mm_stats");
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                mm_free_batch((void **) &trace->blocks[index], trace->ops[i].count);
+                break;
+
+            case ARENA_ALLOC: /* mm_arena_alloc */
+                if ((p = arena_request(&arena, size)) == NULL)
+                    app_error("mm_arena_alloc error in eval_mm_stats");
+                trace->blocks[index] = p;
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                if (arena != NULL)
+                    mm_arena_reset(arena);
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_stats");
+        }
+    }
+    /* The arena's chunks are counted as used blocks */
+    if (!mm_stats(alloc)) {
+        free(alloc);
+        alloc = NULL;
+    }
+    if (arena != NULL)
+        mm_arena_destroy(arena);
+    return alloc;
+}
+
+/*
+ * frag_file - open the CSV file prefix_<trace>.csv in the current
+ *    directory for the trace filename
+ */
+static FILE *frag_file(const char *prefix, const char *filename)
+{
+    char name[MAXLINE + 32];
+    const char *base = strrchr(filename, '/');
+    FILE *out;
+
+    snprintf(name, sizeof(name), "%s_%s.csv", prefix, base ? base + 1 : filename);
+    if ((out = fopen(name, "w")) == NULL)
+        unix_error("Could not open %s in eval_mm_frag", name);
+    return out;
+}
+
+/*
+ * frag_sample - write one line of the fragmentation timeline after
+ *    request opnum, with live payload bytes
+ */
+static void frag_sample(FILE *out, int opnum, size_t live)
+{
+    struct mm_stats a;
+    int b;
+
+    mm_stats(&a);
+    fprintf(out, "%d,%zu,%zu,%zu,%zu,%zu,%zu,%.4f", opnum + 1, live,
+            mem_heapsize() + mem_mapped(), a.used_bytes, a.deferred_bytes,
+            a.free_bytes, a.largest_free,
+            a.free_bytes ? 1 - (double) a.largest_free / a.free_bytes : 0.0);
+    for (b = 0; b < MM_STATS_BINS; b++)
+        fprintf(out, ",%zu", a.bin_bytes[b]);
+    fprintf(out, "\n");
+}
+
+/*
+ * eval_mm_frag - replay the trace and write its fragmentation timeline,
+ *    sampled every frag_interval requests, to frag_<trace>.csv and the
+ *    blocks of the heap after request peak to heapmap_<trace>.csv.
+ *    External fragmentation is the share of free bytes that are not in
+ *    the largest free block. The stats build this needs lays out the same
+ *    heap as the release build, so both files show the scored placement.
+ */
+static void eval_mm_frag(trace_t *trace, int peak)
+{
+    int i, b, index;
+    size_t size, live = 0, num_blocks;
+    char *p;
+    FILE *out = frag_file("frag", trace->filename);
+    FILE *map;
+    struct mm_block *blocks;
+    struct mm_arena *arena = NULL;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_frag");
+
+    fprintf(out, "op,live_bytes,heap_bytes,used_bytes,deferred_bytes,"
+            "free_bytes,largest_free,ext_frag");
+    for (b = 0; b < MM_STATS_BINS; b++)
+        fprintf(out, ",list_%d", b);
+    fprintf(out, "\n");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type) {
+
+            case ALLOC: /* mm_malloc */
+                if ((p = mm_malloc(size)) == NULL)
+                    app_error("mm_malloc error in eval_mm_frag");
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                live += size;
+                break;
+
+            case REALLOC: /* mm_realloc */
+                p = mm_realloc(trace->blocks[index], size);
+                if (p == NULL && size != 0)
+                    app_error("mm_realloc error in eval_mm_frag");
+                trace->blocks[index] = p;
+                live += size - trace->block_sizes[index];
+                trace->block_sizes[index] = size;
+                break;
+
+            case FREE: /* mm_free */
+                if (index < 0) {
+                    mm_free(NULL);
+                    break;
+                }
+                mm_free(trace->blocks[index]);
+                live -= trace->block_sizes[index];
+                trace->block_sizes[index] = 0;
+                break;
+
+            case ALLOC_BATCH: /* mm_malloc_batch */
+                if (mm_malloc_batch(size, trace->ops[i].count, (void **) &trace->blocks[index])
+                    != (size_t) trace->ops[i].count)
+                    app_error("mm_malloc_batch error in eval_mm_frag");
+                for (b = index; b < index + trace->ops[i].count; b++)
+                    trace->block_sizes[b] = size;
+                live += trace->ops[i].count * size;
+                break;
+
+            case FREE_BATCH: /* mm_free_batch */
+                for (b = index; b < index + trace->ops[i].count; b++) {
+                    live -= trace->block_sizes[b];
+                    trace->block_sizes[b] = 0;
+                }
+                mm_free_batch((void **) &trace->blocks[index], trace->ops[i].count);
+                break;
+
+            case ARENA_ALLOC: /* mm_arena_alloc */
+                if ((p = arena_request(&arena, size)) == NULL)
+                    app_error("mm_arena_alloc error in eval_mm_frag");
+                trace->blocks[index] = p;
+                trace->block_sizes[index] = size;
+                live += size;
+                break;
+
+            case ARENA_RESET: /* mm_arena_reset */
+                for (b = index; b < i; b++) {
+                    if (trace->ops[b].type == ARENA_ALLOC) {
+                        live -= trace->block_sizes[trace->ops[b].index];
+                        trace->block_sizes[trace->ops[b].index] = 0;
+                    }
+                }
+                if (arena != NULL)
+                    mm_arena_reset(arena);
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_frag");
+        }
+
+        if ((i + 1) % frag_interval == 0 || i == trace->num_ops - 1)
+            frag_sample(out, i, live);
+
+        if (i == peak) {
+            /* Ask for the count first, the driver's own allocations do
+               not touch the heap */
+            num_blocks = mm_heap_map(NULL, 0);
+            if ((blocks = malloc(num_blocks * sizeof(struct mm_block))) == NULL)
+                unix_error("malloc failed in eval_mm_frag");
+            mm_heap_map(blocks, num_blocks);
+            map = frag_file("heapmap", trace->filename);
+            fprintf(map, "offset,size,state\n");
+            for (size_t k = 0; k < num_blocks; k++)
+                fprintf(map, "%zu,%zu,%c\n", blocks[k].offset, blocks[k].size,
+                        blocks[k].state);
+            fclose(map);
+            free(blocks);
+        }
+    }
+    if (arena != NULL)
+        mm_arena_destroy(arena);
+    fclose(out);
+}
+
+/*
+ * print_alloc_stats - print the allocator statistics taken with -S and
+ *    free them
+ */
+static void print_alloc_stats(int n, stats_t *stats)
+{
+    int i, b;
+
+    printf("Allocator statistics at the peak of each trace:\n");
+    for (i = 0; i < n; i++) {
+        struct mm_stats *a = stats[i].alloc;
+        if (a == NULL)
+            continue;
+        printf("  %s, after line %d\n", stats[i].filename,
+               LINENUM(stats[i].peak_op));
+        printf("    heap %zu KiB: %zu KiB in %zu used blocks (%zu KiB slab runs), "
+               "%zu KiB deferred, %zu KiB in %zu free blocks, largest %zu\n",
+               a->heap_bytes >> 10, a->used_bytes >> 10, a->used_blocks,
+               a->slab_bytes >> 10, a->deferred_bytes >> 10,
+               a->free_bytes >> 10, a->free_blocks, a->largest_free);
+        printf("    %zu mallocs, %zu frees, %zu extends, %zu maps, "
+               "%zu splits, %zu coalesces\n",
+               a->mallocs, a->frees, a->extends, a->maps,
+               a->splits, a->coalesces);
+        printf("    %zu searches, %.2f nodes scanned per search\n",
+               a->searches,
+               a->searches ? (double) a->scanned / a->searches : 0.0);
+        printf("    free bytes by list:");
+        for (b = 0; b < MM_STATS_BINS; b++) {
+            if (a->bin_blocks[b] != 0)
+                printf(" [%d] %zu/%zu", b, a->bin_bytes[b], a->bin_blocks[b]);
+        }
+        printf("\n");
+        free(a);
+        stats[i].alloc = NULL;
+    }
+    printf("\n");
+}
+
+/*
+ * class_bucket - the histogram bucket of the block mm.c makes for a
+ *    request of size bytes, or -1 if the block is not kept in a list
+ */
+static int class_bucket(size_t size)
+{
+    size_t block = (size + sizeof(size_t) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+
+    if (size <= CLASS_SMALL || size >= CLASS_HUGE || block >= CLASS_TREE)
+        return -1;
+    return (int) (block / CLASS_UNIT);
+}
+
+/*
+ * class_histograms - add the requests of trace to requests[] and the
+ *    number of its live blocks, averaged over the trace, to live[],
+ *    both by bucket and per request of the trace
+ */
+static void class_histograms(const trace_t *trace, double *requests, double *live)
+{
+    int *bucket = malloc(trace->num_ids * sizeof(int));
+    long *count = calloc(CLASS_BUCKETS, sizeof(long));
+    long *since = calloc(CLASS_BUCKETS, sizeof(long));
+    double *area = calloc(CLASS_BUCKETS, sizeof(double));
+    double n = trace->num_ops;
+    int b, i;
+
+    if (bucket == NULL || count == NULL || since == NULL || area == NULL)
+        unix_error("malloc failed in class_histograms");
+    for (i = 0; i < trace->num_ids; i++)
+        bucket[i] = -1;
+
+    /* A bucket's area grows by its count for every request it holds it */
+    for (i = 0; i < trace->num_ops; i++) {
+        const traceop_t *op = &trace->ops[i];
+        bool batch = op->type == ALLOC_BATCH || op->type == FREE_BATCH;
+        long id;
+
+        /* Arena objects live in chunks, which are never in the lists long */
+        if (op->type == ARENA_ALLOC || op->type == ARENA_RESET)
+            continue;
+
+        if (op->type == ALLOC || op->type == REALLOC || op->type == ALLOC_BATCH) {
+            b = class_bucket(op->size);
+            if (b >= 0)
+                requests[b] += (batch ? op->count : 1) / n;
+        } else {
+            b = -1;
+        }
+        for (id = op->index; id < op->index + (batch ? op->count : 1); id++) {
+            int old = bucket[id];
+            if (old == b)
+                continue;
+            if (old >= 0) {
+                area[old] += (double) count[old] * (i - since[old]);
+                since[old] = i;
+                count[old]--;
+            }
+            if (b >= 0) {
+                area[b] += (double) count[b] * (i - since[b]);
+                since[b] = i;
+                count[b]++;
+            }
+            bucket[id] = b;
+        }
+    }
+    for (b = 0; b < CLASS_BUCKETS; b++)
+        live[b] += (area[b] + (double) count[b] * (n - since[b])) / n;
+
+    free(bucket);
+    free(count);
+    free(since);
+    free(area);
+}
+
+/*
+ * Prefix sums over the buckets, so the cost of any class is found in
+ * constant time: req[k], reqk[k] and reqlive[k] sum requests[j],
+ * j*requests[j] and requests[j]*livebelow[j] for j < k, where livebelow[j]
+ * is live[k] over the buckets k < j
+ */
+typedef struct {
+    double req[CLASS_BUCKETS + 1];
+    double reqk[CLASS_BUCKETS + 1];
+    double reqlive[CLASS_BUCKETS + 1];
+    double live[CLASS_BUCKETS + 1];
+} class_sums_t;
+
+/*
+ * class_cost - expected cost per request of a free list holding the
+ *    blocks of buckets [a, b). A request that misses its list is cut
+ *    from a block of the next one, leaving at least the slack to the
+ *    top of the class, and a request that hits it passes the smaller
+ *    blocks of the list first, which are taken from the live sizes.
+ */
+static double class_cost(const class_sums_t *s, int a, int b)
+{
+    double req = s->req[b] - s->req[a];
+    double slack = CLASS_UNIT * (b * req - (s->reqk[b] - s->reqk[a]));
+    double scan = s->reqlive[b] - s->reqlive[a] - s->live[a] * req;
+
+    return slack + CLASS_SCAN_BYTES * scan;
+}
+
+/*
+ * eval_classes - propose free list boundaries for the traces and write
+ *    them to outfile as a header for make CLASSES=<outfile>. The
+ *    boundaries are the ones of least total class_cost, found by
+ *    dynamic programming over the histogram buckets.
+ */
+static void eval_classes(const char *outfile)
+{
+    double *requests = calloc(CLASS_BUCKETS, sizeof(double));
+    double *live = calloc(CLASS_BUCKETS, sizeof(double));
+    class_sums_t *s = malloc(sizeof(class_sums_t));
+    double *best = malloc(CLASS_LISTS * (CLASS_BUCKETS + 1) * sizeof(double));
+    short *from = malloc(CLASS_LISTS * (CLASS_BUCKETS + 1) * sizeof(short));
+    int lo[CLASS_LISTS + 1], tlsf[CLASS_LISTS + 1];
+    int first = CLASS_SMALL / CLASS_UNIT;
+    int a, b, c, i, k, fixed;
+    FILE *out;
+
+    if (requests == NULL || live == NULL || s == NULL || best == NULL || from == NULL)
+        unix_error("malloc failed in eval_classes");
+
+    for (i = 0; i < num_global_tracefiles; i++) {
+        stats_t stats;
+        trace_t *trace = read_trace(&stats, tracedir, global_tracefiles[i]);
+        class_histograms(trace, requests, live);
+        free_trace(trace);
+    }
+    for (b = 0; b < CLASS_BUCKETS; b++) {
+        requests[b] /= num_global_tracefiles;
+        live[b] /= num_global_tracefiles;
+    }
+
+    s->req[0] = s->reqk[0] = s->reqlive[0] = s->live[0] = 0;
+    for (k = 0; k < CLASS_BUCKETS; k++) {
+        s->req[k + 1] = s->req[k] + requests[k];
+        s->reqk[k + 1] = s->reqk[k] + k * requests[k];
+        s->reqlive[k + 1] = s->reqlive[k] + requests[k] * s->live[k];
+        s->live[k + 1] = s->live[k] + live[k];
+    }
+
+    /* The classes mm.c uses without a header: 16 bytes apart below 128,
+       then four to each power of two */
+    for (c = 0; c < 7; c++)
+        tlsf[c] = c + 1;
+    for (c = 7; c < CLASS_LISTS; c++)
+        tlsf[c] = (128 << ((c - 7) / 4)) / CLASS_UNIT * (4 + (c - 7) % 4) / 4;
+    tlsf[CLASS_LISTS] = CLASS_BUCKETS;
+
+    /* The lists below the smallest request only ever get the remainders
+       of splits, which the traces do not show, so they are kept */
+    for (fixed = 0; tlsf[fixed] < first; fixed++)
+        lo[fixed] = tlsf[fixed];
+
+    /* best[c][b] is the least cost of classes fixed..c covering [first, b) */
+    for (b = first + 1; b <= CLASS_BUCKETS; b++) {
+        best[fixed * (CLASS_BUCKETS + 1) + b] = class_cost(s, first, b);
+        from[fixed * (CLASS_BUCKETS + 1) + b] = first;
+    }
+    for (c = fixed + 1; c < CLASS_LISTS; c++) {
+        double *prev = best + (c - 1) * (CLASS_BUCKETS + 1);
+        double *cur = best + c * (CLASS_BUCKETS + 1);
+        short *back = from + c * (CLASS_BUCKETS + 1);
+        for (b = first + c - fixed + 1; b <= CLASS_BUCKETS; b++) {
+            cur[b] = DBL_MAX;
+            for (a = first + c - fixed; a < b; a++) {
+                double cost = prev[a] + class_cost(s, a, b);
+                if (cost < cur[b]) {
+                    cur[b] = cost;
+                    back[b] = a;
+                }
+            }
+        }
+    }
+    lo[CLASS_LISTS] = CLASS_BUCKETS;
+    for (c = CLASS_LISTS - 1; c >= fixed; c--)
+        lo[c] = from[c * (CLASS_BUCKETS + 1) + lo[c + 1]];
+
+    double proposed = 0, current = 0;
+    for (c = 0; c < CLASS_LISTS; c++) {
+        proposed += class_cost(s, lo[c], lo[c + 1]);
+        current += class_cost(s, tlsf[c], tlsf[c + 1]);
+    }
+
+    if ((out = fopen(outfile, "w")) == NULL)
+        unix_error("Could not open %s in eval_classes", outfile);
+    fprintf(out, "/*\n * Free list size classes made by mdriver -G from\n");
+    for (i = 0; i < num_global_tracefiles; i++)
+        fprintf(out, " *   %s\n", global_tracefiles[i]);
+    fprintf(out, " *\n * Build with make CLASSES=%s (after make clean).\n"
+            " * class_index[size/%d] is the list of a free block of size bytes,\n"
+            " * blocks of class_tree bytes and up are kept in the tree.\n",
+            outfile, CLASS_UNIT);
+    fprintf(out, " * List floors in bytes:");
+    for (c = 0; c < CLASS_LISTS; c++)
+        fprintf(out, "%s%d", c % 10 ? " " : "\n *  ", lo[c] * CLASS_UNIT);
+    fprintf(out, "\n */\n");
+    fprintf(out, "#define class_lists %d\n#define class_tree %d\n\n",
+            CLASS_LISTS, CLASS_TREE);
+    fprintf(out, "static const uint8_t class_index[class_tree/%d]={", CLASS_UNIT);
+    for (c = 0, k = 0; k < CLASS_BUCKETS; k++) {
+        while (k >= lo[c + 1])
+            c++;
+        fprintf(out, "%s%d,", k % 32 ? "" : "\n    ", k < lo[0] ? 0 : c);
+    }
+    fprintf(out, "\n};\n");
+    fclose(out);
+
+    printf("Size classes for %d traces written to %s\n", num_global_tracefiles, outfile);
+    printf("%5s %11s %9s %9s\n", "list", "bytes", "of ops", "live");
+    for (c = 0; c < CLASS_LISTS; c++) {
+        a = lo[c];
+        b = lo[c + 1];
+        if (s->req[b] - s->req[a] == 0 && s->live[b] - s->live[a] == 0)
+            continue;
+        printf("%5d %5d-%-5d %8.2f%% %9.1f\n", c, a * CLASS_UNIT, b * CLASS_UNIT - 1,
+               100 * (s->req[b] - s->req[a]), s->live[b] - s->live[a]);
+    }
+    printf("Cost per request: %.1f bytes, %.1f with the default classes\n",
+           proposed, current);
+
+    free(requests);
+    free(live);
+    free(s);
+    free(best);
+    free(from);
 }
 
 /*
@@ -1356,7 +3304,7 @@ static void eval_mm_speed(void *ptr)
  */
 static bool eval_libc_valid(trace_t *trace)
 {
-    int i;
+    int i, j;
     size_t newsize;
     char *p, *newp, *oldp;
 
@@ -1391,6 +3339,36 @@ static bool eval_libc_valid(trace_t *trace)
                 }
                 break;
 
+            case ALLOC_BATCH: /* one malloc per block */
+                for (j = 0; j < trace->ops[i].count; j++) {
+                    if ((p = malloc(trace->ops[i].size)) == NULL) {
+                        malloc_error(trace, i, "libc malloc failed");
+                        unix_error("System message");
+                    }
+                    trace->blocks[trace->ops[i].index + j] = p;
+                }
+                break;
+
+            case FREE_BATCH: /* one free per block */
+                for (j = 0; j < trace->ops[i].count; j++)
+                    free(trace->blocks[trace->ops[i].index + j]);
+                break;
+
+            case ARENA_ALLOC: /* malloc */
+                if ((p = malloc(trace->ops[i].size)) == NULL) {
+                    malloc_error(trace, i, "libc malloc failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index] = p;
+                break;
+
+            case ARENA_RESET: /* one free per arena object */
+                for (j = trace->ops[i].index; j < i; j++) {
+                    if (trace->ops[j].type == ARENA_ALLOC)
+                        free(trace->blocks[trace->ops[j].index]);
+                }
+                break;
+
             default:
                 app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1406,7 +3384,7 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
@@ -1443,6 +3421,35 @@ static void eval_libc_speed(void *ptr)
                     free(0);
                 }
                 break;
+
+            case ALLOC_BATCH: /* one malloc per block */
+                index = trace->ops[i].index;
+                for (j = 0; j < trace->ops[i].count; j++) {
+                    if ((p = malloc(trace->ops[i].size)) == NULL)
+                        unix_error("malloc failed in eval_libc_speed");
+                    trace->blocks[index + j] = p;
+                }
+                break;
+
+            case FREE_BATCH: /* one free per block */
+                index = trace->ops[i].index;
+                for (j = 0; j < trace->ops[i].count; j++)
+                    free(trace->blocks[index + j]);
+                break;
+
+            case ARENA_ALLOC: /* malloc */
+                index = trace->ops[i].index;
+                if ((p = malloc(trace->ops[i].size)) == NULL)
+                    unix_error("malloc failed in eval_libc_speed");
+                trace->blocks[index] = p;
+                break;
+
+            case ARENA_RESET: /* one free per arena object */
+                for (j = trace->ops[i].index; j < i; j++) {
+                    if (trace->ops[j].type == ARENA_ALLOC)
+                        free(trace->blocks[trace->ops[j].index]);
+                }
+                break;
         }
     }
 }
@@ -1472,7 +3479,12 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
 
     /* Print the individual results for each trace */
     if (tab_mode) {
-        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\ttrace\n");
+        printf("valid\tthru?\tutil?\tutil\tops\tmsecs\tKops\t%strace\n",
+               counters_mode ? "cyc\tins\tL1miss\tLLCmiss\tTLBmiss\t" : "");
+    } else if (counters_mode) {
+        printf("  %5s  %6s %7s%8s%8s %8s%8s%8s%8s%8s  %s\n",
+               "valid", "util", "ops", "msecs", "Kops",
+               "cyc", "ins", "L1miss", "LLCmiss", "TLBmiss", "trace");
     } else {
         printf("  %5s  %6s %7s%8s%8s  %s\n",
                "valid", "util", "ops", "msecs", "Kops", "trace");
@@ -1538,6 +3550,19 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
                     printf("%8s%10s%7s ", "--", "--", "--");
             }
 
+            /* Hardware events per request of the timed run */
+            for (int e = 0; counters_mode && e < FCYC_EVENTS; e++) {
+                double count = stats[i].counters[e];
+                if (tab_mode)
+                    printf(count >= 0 ? "%.2f\t" : "-\t", count);
+                else if (count >= 0)
+                    printf("%8.1f", count);
+                else
+                    printf("%8s", "-");
+            }
+            if (counters_mode && !tab_mode)
+                printf(" ");
+
             printf("%s\n", stats[i].filename);
 
             if (stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1617,6 +3642,26 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * print_memory - print how much of the heap still holds memory once each
+ *                trace is done, which shows what the allocator gave back
+ */
+static void print_memory(int n, stats_t *stats)
+{
+    int i;
+
+    printf("Memory in KiB once each trace is done:\n");
+    printf("  %12s%12s%12s  %s\n", "peak heap", "heap", "resident", "trace");
+    for (i = 0; i < n; i++) {
+        if (!stats[i].valid)
+            continue;
+        printf("  %12zu%12zu%12zu  %s\n", stats[i].peak_heap >> 10,
+               stats[i].end_heap >> 10, stats[i].end_resident >> 10,
+               stats[i].filename);
+    }
+    printf("\n");
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1840,5 +3885,24 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
-    fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-f <file>  Use <file> as the trace file, .rep or made by rep2bin\n");
+    fprintf(stderr, "\t-B         Check overlaps with a block table, not a splay tree.\n");
+    fprintf(stderr, "\t-C         Clear the last level cache before each timing.\n");
+    fprintf(stderr, "\t-z         Free with mm_free_sized, passing the requested size.\n");
+    fprintf(stderr, "\t-P         Print cycles, instructions and misses per request.\n");
+    fprintf(stderr, "\t-r         Print heap size and resident bytes of each trace.\n");
+    fprintf(stderr, "\t-S         Print allocator statistics of each trace (make stats).\n");
+    fprintf(stderr, "\t-F <n>     Write frag_<trace>.csv every n requests and heapmap_<trace>.csv\n");
+    fprintf(stderr, "\t           at the peak of each trace (make stats).\n");
+    fprintf(stderr, "\t-L         Print latency percentiles of each request type.\n");
+    fprintf(stderr, "\t-W <n>     With -L, also list the n slowest requests.\n");
+    fprintf(stderr, "\t-G <file>  Write size classes fitted to the traces to <file>.\n");
+    fprintf(stderr, "\t-p <n>     Check traces on n processes, then time them in turn.\n");
+    fprintf(stderr, "\t-j <n>     Also replay each trace on n threads (mdriver-mt).\n");
+    fprintf(stderr, "\t-x <pct>   With -j, hand pct%% of frees to another thread.\n");
+    fprintf(stderr, "\t-b <k>     Time each trace k more times on one CPU, print medians\n");
+    fprintf(stderr, "\t           and 95%% confidence intervals of Kops, util and p99 latency.\n");
+    fprintf(stderr, "\t-o <file>  With -b, write the samples to <file> as JSON.\n");
+    fprintf(stderr, "\t-R <file>  With -b, flag significant changes from the samples in\n");
+    fprintf(stderr, "\t           <file> and exit with status 2 on a regression.\n");
 }
@@ -4,6 +4,7 @@
  * package with the system's malloc package in libc.
  *
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -22,19 +23,43 @@
 static unsigned char *heap;                 /* Starting address of heap */
 static unsigned char *mem_brk;              /* Current position of break */
 static unsigned char *mem_max_addr;         /* Maximum allowable heap address */
+static unsigned char *mem_max_brk;          /* Highest break since the last mem_release, the heap
+                                               reads as zero from here on */
+
+/* Regions mapped by mm_mmap, outside the heap */
+#define MAX_REGIONS 4096
+static struct {
+    unsigned char *addr;
+    size_t len;
+} regions[MAX_REGIONS];
+static int num_regions;                     /* entries in use, unordered */
+static size_t mapped_bytes;                 /* total length of the regions */
 
 /* 
  * mm_sbrk - simple model of the sbrk function. Extends the heap 
  *           by incr bytes and returns the start address of the
- *           new area. In this model, the heap cannot be shrunk.
+ *           new area. A negative incr shrinks the heap and the
+ *           pages above the new break are given back.
  */
 void *mm_sbrk(intptr_t incr) {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
     if (incr < 0) {
-	ok = false;
-	fprintf(stderr, "ERROR: mm_sbrk failed.  Attempt to expand heap by negative value %ld\n", (long) incr);
+	if ((size_t) -incr > (size_t) (mem_brk - heap)) {
+	    ok = false;
+	    fprintf(stderr, "ERROR: mm_sbrk failed.  Attempt to shrink heap by %ld, below its start\n", (long) incr);
+	} else {
+	    /* The page that holds the new break stays */
+	    uintptr_t page = mm_pagesize();
+	    unsigned char *top = (unsigned char *) (((uintptr_t) old_brk + page - 1) & ~(page - 1));
+	    mem_brk += incr;
+	    mm_release(mem_brk, top - mem_brk);
+	    /* Memory the break left behind on an earlier run may still be dirty */
+	    if (mem_max_brk <= top)
+		mem_max_brk = (unsigned char *) (((uintptr_t) mem_brk + page - 1) & ~(page - 1));
+	    return (void *) old_brk;
+	}
     } else if (mem_brk + incr > mem_max_addr) {
 	ok = false;
 	long alloc = mem_brk - heap + incr;
@@ -42,6 +67,8 @@ void *mm_sbrk(intptr_t incr) {
     }
     if (ok) {
 	mem_brk += incr;
+	if (mem_brk > mem_max_brk)
+	    mem_max_brk = mem_brk;
 	return (void *) old_brk;
     } else {
 	errno = ENOMEM;
@@ -49,6 +76,87 @@ void *mm_sbrk(intptr_t incr) {
     }
 }
 
+/*
+ * mm_release - give the whole pages inside [addr, addr+len) back to
+ *              the OS. They read as zero when they are next touched.
+ */
+int mm_release(void *addr, size_t len) {
+    uintptr_t page = mm_pagesize();
+    uintptr_t lo = ((uintptr_t) addr + page - 1) & ~(page - 1);
+    uintptr_t hi = ((uintptr_t) addr + len) & ~(page - 1);
+
+    if ((unsigned char *) addr < heap || (unsigned char *) addr + len > mem_max_addr)
+	return -1;
+    if (hi <= lo)
+	return 0;
+    return madvise((void *) lo, hi - lo, MADV_DONTNEED);
+}
+
+/*
+ * find_region - index of the region that starts at addr, or -1
+ */
+static int find_region(void *addr) {
+    for (int i = 0; i < num_regions; i++)
+	if (regions[i].addr == addr)
+	    return i;
+    return -1;
+}
+
+/*
+ * mm_mmap - map a private region of len bytes (a multiple of the page
+ *           size) outside the heap. Returns (void *) -1 on failure.
+ */
+void *mm_mmap(size_t len) {
+    if (num_regions == MAX_REGIONS) {
+	errno = ENOMEM;
+	return (void *) -1;
+    }
+    void *addr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+	return (void *) -1;
+    regions[num_regions].addr = addr;
+    regions[num_regions].len = len;
+    num_regions++;
+    mapped_bytes += len;
+    return addr;
+}
+
+/*
+ * mm_munmap - unmap a whole region returned by mm_mmap or mm_mremap
+ */
+int mm_munmap(void *addr, size_t len) {
+    int i = find_region(addr);
+    if (i < 0 || regions[i].len != len) {
+	fprintf(stderr, "ERROR: mm_munmap failed.  %p:%zu is not a mapped region\n", addr, len);
+	return -1;
+    }
+    if (munmap(addr, len) != 0)
+	return -1;
+    mapped_bytes -= len;
+    regions[i] = regions[--num_regions];
+    return 0;
+}
+
+/*
+ * mm_mremap - resize a region to new_len bytes, moving it if needed.
+ *             Returns the new address or (void *) -1 on failure.
+ */
+void *mm_mremap(void *addr, size_t old_len, size_t new_len) {
+    int i = find_region(addr);
+    if (i < 0 || regions[i].len != old_len) {
+	fprintf(stderr, "ERROR: mm_mremap failed.  %p:%zu is not a mapped region\n", addr, old_len);
+	return (void *) -1;
+    }
+    void *new_addr = mremap(addr, old_len, new_len, MREMAP_MAYMOVE);
+    if (new_addr == MAP_FAILED)
+	return (void *) -1;
+    regions[i].addr = new_addr;
+    regions[i].len = new_len;
+    mapped_bytes += new_len - old_len;
+    return new_addr;
+}
+
 /*
  * mm_heap_lo - return address of the first heap byte
  */
@@ -63,6 +171,15 @@ void *mm_heap_hi(){
     return (void *)(mem_brk - 1);
 }
 
+/*
+ * mm_heap_clean - return the first address from which the heap reads as
+ *                 zero, memory above every break since it was last given
+ *                 back has not been written
+ */
+void *mm_heap_clean(){
+    return (void *) mem_max_brk;
+}
+
 /*
  * mm_heapsize - returns the heap size in bytes
  */
@@ -78,46 +195,224 @@ size_t mm_pagesize(){
 }
 
 /*
- * mm_memcpy - copies n bytes from src to dst
+ * copy_words - copy n bytes a word at a time through mem_read/mem_write,
+ *              the scalar path for short moves and for vector tails
  */
-void *mm_memcpy(void *dst, const void *src, size_t n) {
-    void *savedst = dst;
+static void copy_words(unsigned char *dst, const unsigned char *src, size_t n) {
     size_t w = sizeof(uint64_t);
     while (n >= w) {
 	uint64_t data = mem_read(src, w);
 	mem_write(dst, data, w);
 	n -= w;
-	src = (void *) ((unsigned char *) src + w);
-	dst = (void *) ((unsigned char *) dst + w);
+	src += w;
+	dst += w;
     }
     if (n) {
 	uint64_t data = mem_read(src, n);
 	mem_write(dst, data, n);
     }
-    return savedst;
 }
 
 /*
- * mm_memset - sets the first n bytes of memory pointed to by dst to c
+ * set_words - store the byte pattern in data over n bytes through mem_write
  */
-void *mm_memset(void *dst, int c, size_t n) {
-    void *savedst = dst;
-    uint64_t byte = c & 0xFF;
-    uint64_t data = 0;
+static void set_words(unsigned char *dst, uint64_t data, size_t n) {
     size_t w = sizeof(uint64_t);
-    size_t i;
-    for (i = 0; i < w; i++) {
-	data = data | (byte << (8*i));
-    }
     while (n >= w) {
 	mem_write(dst, data, w);
 	n -= w;
-	dst = (void *) ((unsigned char *) dst + w);
+	dst += w;
     }
     if (n) {
-	mem_write(dst, data, n);	
+	mem_write(dst, data, n);
+    }
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+#define VEC_MIN 64                  /* Shorter moves stay on the scalar path */
+#define STREAM_MIN (4*1024*1024)    /* Longer moves bypass the cache */
+
+/*
+ * The vector routines take the scalar path up to the first aligned
+ * destination byte, which payloads already are, so the loop only does
+ * aligned stores. Sources may be unaligned.
+ */
+static void copy_sse2(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t head = -(uintptr_t) dst & 15;
+    copy_words(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+    bool stream = n >= STREAM_MIN;
+    for (; n >= 64; n -= 64, src += 64, dst += 64) {
+	__m128i a = _mm_loadu_si128((const __m128i *) src);
+	__m128i b = _mm_loadu_si128((const __m128i *) (src + 16));
+	__m128i c = _mm_loadu_si128((const __m128i *) (src + 32));
+	__m128i d = _mm_loadu_si128((const __m128i *) (src + 48));
+	if (stream) {
+	    _mm_stream_si128((__m128i *) dst, a);
+	    _mm_stream_si128((__m128i *) (dst + 16), b);
+	    _mm_stream_si128((__m128i *) (dst + 32), c);
+	    _mm_stream_si128((__m128i *) (dst + 48), d);
+	} else {
+	    _mm_store_si128((__m128i *) dst, a);
+	    _mm_store_si128((__m128i *) (dst + 16), b);
+	    _mm_store_si128((__m128i *) (dst + 32), c);
+	    _mm_store_si128((__m128i *) (dst + 48), d);
+	}
     }
-    return savedst;
+    if (stream)
+	_mm_sfence();
+    for (; n >= 16; n -= 16, src += 16, dst += 16)
+	_mm_store_si128((__m128i *) dst, _mm_loadu_si128((const __m128i *) src));
+    copy_words(dst, src, n);
+}
+
+static void set_sse2(unsigned char *dst, int c, size_t n) {
+    uint64_t data = 0x0101010101010101ULL * (unsigned char) c;
+    size_t head = -(uintptr_t) dst & 15;
+    set_words(dst, data, head);
+    dst += head;
+    n -= head;
+    bool stream = n >= STREAM_MIN;
+    __m128i v = _mm_set1_epi8((char) c);
+    for (; n >= 64; n -= 64, dst += 64) {
+	if (stream) {
+	    _mm_stream_si128((__m128i *) dst, v);
+	    _mm_stream_si128((__m128i *) (dst + 16), v);
+	    _mm_stream_si128((__m128i *) (dst + 32), v);
+	    _mm_stream_si128((__m128i *) (dst + 48), v);
+	} else {
+	    _mm_store_si128((__m128i *) dst, v);
+	    _mm_store_si128((__m128i *) (dst + 16), v);
+	    _mm_store_si128((__m128i *) (dst + 32), v);
+	    _mm_store_si128((__m128i *) (dst + 48), v);
+	}
+    }
+    if (stream)
+	_mm_sfence();
+    for (; n >= 16; n -= 16, dst += 16)
+	_mm_store_si128((__m128i *) dst, v);
+    set_words(dst, data, n);
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t head = -(uintptr_t) dst & 31;
+    copy_words(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+    bool stream = n >= STREAM_MIN;
+    for (; n >= 128; n -= 128, src += 128, dst += 128) {
+	__m256i a = _mm256_loadu_si256((const __m256i *) src);
+	__m256i b = _mm256_loadu_si256((const __m256i *) (src + 32));
+	__m256i c = _mm256_loadu_si256((const __m256i *) (src + 64));
+	__m256i d = _mm256_loadu_si256((const __m256i *) (src + 96));
+	if (stream) {
+	    _mm256_stream_si256((__m256i *) dst, a);
+	    _mm256_stream_si256((__m256i *) (dst + 32), b);
+	    _mm256_stream_si256((__m256i *) (dst + 64), c);
+	    _mm256_stream_si256((__m256i *) (dst + 96), d);
+	} else {
+	    _mm256_store_si256((__m256i *) dst, a);
+	    _mm256_store_si256((__m256i *) (dst + 32), b);
+	    _mm256_store_si256((__m256i *) (dst + 64), c);
+	    _mm256_store_si256((__m256i *) (dst + 96), d);
+	}
+    }
+    if (stream)
+	_mm_sfence();
+    for (; n >= 32; n -= 32, src += 32, dst += 32)
+	_mm256_store_si256((__m256i *) dst, _mm256_loadu_si256((const __m256i *) src));
+    copy_words(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void set_avx2(unsigned char *dst, int c, size_t n) {
+    uint64_t data = 0x0101010101010101ULL * (unsigned char) c;
+    size_t head = -(uintptr_t) dst & 31;
+    set_words(dst, data, head);
+    dst += head;
+    n -= head;
+    bool stream = n >= STREAM_MIN;
+    __m256i v = _mm256_set1_epi8((char) c);
+    for (; n >= 128; n -= 128, dst += 128) {
+	if (stream) {
+	    _mm256_stream_si256((__m256i *) dst, v);
+	    _mm256_stream_si256((__m256i *) (dst + 32), v);
+	    _mm256_stream_si256((__m256i *) (dst + 64), v);
+	    _mm256_stream_si256((__m256i *) (dst + 96), v);
+	} else {
+	    _mm256_store_si256((__m256i *) dst, v);
+	    _mm256_store_si256((__m256i *) (dst + 32), v);
+	    _mm256_store_si256((__m256i *) (dst + 64), v);
+	    _mm256_store_si256((__m256i *) (dst + 96), v);
+	}
+    }
+    if (stream)
+	_mm_sfence();
+    for (; n >= 32; n -= 32, dst += 32)
+	_mm256_store_si256((__m256i *) dst, v);
+    set_words(dst, data, n);
+}
+
+/* Chosen by pick_vector on the first long move */
+typedef void copy_fn(unsigned char *dst, const unsigned char *src, size_t n);
+typedef void set_fn(unsigned char *dst, int c, size_t n);
+static copy_fn *copy_vector;
+static set_fn *set_vector;
+
+/*
+ * pick_vector - select the AVX2 routines when the CPU has them, SSE2
+ *               is part of x86-64. Racing callers store the same values.
+ */
+static void pick_vector(void) {
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    __atomic_store_n(&set_vector, avx2 ? set_avx2 : set_sse2, __ATOMIC_RELAXED);
+    __atomic_store_n(&copy_vector, avx2 ? copy_avx2 : copy_sse2, __ATOMIC_RELAXED);
+}
+#endif
+
+/*
+ * mm_memcpy - copies n bytes from src to dst
+ */
+void *mm_memcpy(void *dst, const void *src, size_t n) {
+#ifdef __x86_64__
+    if (n >= VEC_MIN) {
+	copy_fn *copy = __atomic_load_n(&copy_vector, __ATOMIC_RELAXED);
+	if (copy == NULL) {
+	    pick_vector();
+	    copy = copy_vector;
+	}
+	copy(dst, src, n);
+	return dst;
+    }
+#endif
+    copy_words(dst, src, n);
+    return dst;
+}
+
+/*
+ * mm_memset - sets the first n bytes of memory pointed to by dst to c
+ */
+void *mm_memset(void *dst, int c, size_t n) {
+#ifdef __x86_64__
+    if (n >= VEC_MIN) {
+	set_fn *set = __atomic_load_n(&set_vector, __ATOMIC_RELAXED);
+	if (set == NULL) {
+	    pick_vector();
+	    set = set_vector;
+	}
+	set(dst, c, n);
+	return dst;
+    }
+#endif
+    set_words(dst, 0x0101010101010101ULL * (unsigned char) c, n);
+    return dst;
 }
 
 /*************** Memory emulation  *******************/
@@ -138,6 +433,7 @@ void mem_init(){
     }
     heap = addr;
     mem_max_addr = addr + MAX_HEAP_SIZE;
+    mem_max_brk = addr;
     mem_reset_brk();
 }
 
@@ -152,10 +448,73 @@ void mem_deinit(void){
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *                 mapped regions go with it
  */
 void mem_reset_brk(){
     mem_brk = heap;
+    while (num_regions > 0) {
+	num_regions--;
+	munmap(regions[num_regions].addr, regions[num_regions].len);
+    }
+    mapped_bytes = 0;
+}
+
+/*
+ * mem_release - give back every page the heap has used, so pages left
+ *               dirty by an earlier run are not counted as resident
+ */
+void mem_release(void) {
+    if (mem_max_brk > heap)
+	mm_release(heap, (size_t) (mem_max_brk - heap));
+    mem_max_brk = mem_brk;
+}
+
+/*
+ * resident - number of bytes of [addr, addr+len) backed by memory
+ */
+static size_t resident(unsigned char *addr, size_t len) {
+    size_t page = mm_pagesize();
+    size_t pages = (len + page - 1) / page;
+    size_t count = 0;
+    unsigned char vec[4096];
+
+    for (size_t done = 0; done < pages; done += sizeof(vec)) {
+	size_t n = pages - done < sizeof(vec) ? pages - done : sizeof(vec);
+	if (mincore(addr + done * page, n * page, vec) != 0)
+	    return 0;
+	for (size_t i = 0; i < n; i++)
+	    count += vec[i] & 1;
+    }
+    return count * page;
+}
+
+/*
+ * mem_resident - number of heap and region bytes currently backed by memory
+ */
+size_t mem_resident(void) {
+    size_t count = resident(heap, (size_t) (mem_brk - heap));
+    for (int i = 0; i < num_regions; i++)
+	count += resident(regions[i].addr, regions[i].len);
+    return count;
+}
+
+/*
+ * mem_mapped - total length of the regions mapped by mm_mmap
+ */
+size_t mem_mapped(void) {
+    return mapped_bytes;
+}
+
+/*
+ * mem_in_region - true if [lo, hi] lies inside a single mapped region
+ */
+bool mem_in_region(const void *lo, const void *hi) {
+    for (int i = 0; i < num_regions; i++)
+	if ((const unsigned char *) lo >= regions[i].addr
+	    && (const unsigned char *) hi < regions[i].addr + regions[i].len)
+	    return true;
+    return false;
 }
 
 void *mem_sbrk(intptr_t incr) {
@@ -5,8 +5,13 @@
 /* Support routines */
 
 void *mm_sbrk(intptr_t incr);
+int mm_release(void *addr, size_t len);
+void *mm_mmap(size_t len);
+int mm_munmap(void *addr, size_t len);
+void *mm_mremap(void *addr, size_t old_len, size_t new_len);
 void *mm_heap_lo(void);
 void *mm_heap_hi(void);
+void *mm_heap_clean(void);
 size_t mm_heapsize(void);
 size_t mm_pagesize(void);
 void *mm_memcpy(void *dst, const void *src, size_t n);
@@ -19,6 +24,10 @@ void mem_init();
 void mem_deinit(void);
 void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
+void mem_release(void);
+size_t mem_resident(void);
+size_t mem_mapped(void);
+bool mem_in_region(const void *lo, const void *hi);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
@@ -5,13 +5,30 @@
  *
  * This is an implementation of malloc, free and realloc for managing the heap. Each allocated/free block is preceded by a header 
  *containing information about that block. free blocks are additionally added as nodes in 'maxindex' number of linked lists, 
- *based on their size.
+ *based on their size, except the largest ones which are kept in a size-ordered AVL tree for best-fit lookup. 
+ *The list heads and a bitmap of the non-empty lists are kept in a control block at the start of the heap.
  *malloc calls finder() to retrieve a pointer to a free block. finder() calls get_freeblock() which abstracts the linked list 
  *traversal to retrieve a free node. finder() then calls allocate which splits large free nodes. If a free node does not exist, 
- *extend() increases heap memory by the appropriate memory. 
- *free() calls free_hf() which creates the header and footers and coalesces neighboring free blocks.
- *addnode() and removenode() abstract the manipulation of the various circular doubly linked lists pointed to by head[index].
- *mm_checkheap() is called at the beginning and end of each each malloc/free operation to validate heap consistency
+ *extend() increases heap memory by the appropriate memory, reusing a free block that ends at the epilogue. 
+ *trim() gives a big free block at the top back by lowering the break, and free_hf() gives back the interior pages of big free blocks.
+ *free() calls free_hf() which creates the header and footers and coalesces neighboring free blocks. Blocks of up to 4KiB 
+ * *are first held in quick bins of their exact size, still marked allocated, and are coalesced in a batch by flush().
+ *Only free blocks have footers. The header of every block records whether the previous block is allocated and whether it is 
+ *a minimum block of ALIGNMENT bytes, 16 unless the build chooses 32 to 256. Free minimum blocks have no footer, their list links 
+ *are compressed 32 bit offsets. mm_memalign() and its relatives place bigger alignments and free the slack on either side.
+ *Requests of 1MiB and more are given a region of their own by mm_mmap() and unmapped at once by free().
+ *Requests of up to 512 bytes are served by a slab tier: page aligned runs carved from the heap that hold headerless slots of 
+ *one size class. A page map in the control block tells free() whether a pointer lies in a run.
+ *free_sized() takes the class of a slot from the size it was requested with instead of from its run.
+ *calloc() checks nmemb*size for overflow and does not clear memory the heap has never used, which reads as zero.
+ *Built with MM_THREADS (make lib) the heap is guarded by a lock in the control block and every thread caches free slots 
+ *of each class, so most small requests and frees never take the lock.
+ *Built with MM_HARDEN (make HARDEN=1) headers carry a keyed checksum in their top 16 bits and runs a bit per slot in use,
+ *so free() and realloc() abort on double frees, foreign pointers and overflows into the next header.
+ *addnode() and removenode() abstract the manipulation of the various circular doubly linked lists pointed to by head[index] 
+ *and of the tree.
+ *mm_checkheap() is called at the beginning and end of each each malloc/free operation to validate heap consistency, 
+ *MM_CHECK=local or MM_CHECK=<N> limits it to the last block touched, with a full walk every Nth call.
  *printheap() and printlist() can be used to observe the changes in the heap's state during each malloc/free operation.
  * List of shorthands used: f=footer, h=header, n=node
  * 
@@ -25,8 +42,12 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <errno.h>
 #include "mm.h"
 #include "memlib.h"
+#ifdef MM_THREADS
+#include <pthread.h>
+#endif
 
 
 // #define DEBUG
@@ -55,46 +76,207 @@
 #define calloc mm_calloc
 #define memset mm_memset
 #define memcpy mm_memcpy
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
+#define malloc_batch mm_malloc_batch
+#define free_batch mm_free_batch
+#define free_sized mm_free_sized
+#define arena_create mm_arena_create
+#define arena_alloc mm_arena_alloc
+#define arena_reset mm_arena_reset
+#define arena_destroy mm_arena_destroy
 #endif // DRIVER
 
+#ifndef ALIGNMENT
 #define ALIGNMENT 16
+#endif
 #define w 8
-#define maxindex 16
+#define min_block ALIGNMENT
+#define maxindex 44
+#define treeindex (maxindex-1)
+#define exact_limit 128
+#define sub_bits 2
+#define sorted_bins 0
+#define max_heap ((size_t)1<<36)
+#define slab_limit 512
+#define slab_classes 16
+#define run_size 4096
+#define extend_chunk 4096
+#define trim_threshold (1024*1024)
+#define punch_threshold (4096*1024)
+#define map_threshold (1024*1024)
+#define quick_limit 4096
+#define quick_max 256
+#define cache_max 64
+#define cache_batch 16
+#define arena_chunk 16384
+#define arena_max (256*1024)
+#ifdef MM_HARDEN
+#define size_mask (((size_t)1<<48)-1)
+#else
+#define size_mask (~(size_t)0)
+#endif
 
+#ifdef SIZE_CLASSES
+#include SIZE_CLASSES
+_Static_assert(class_lists==treeindex && class_tree==65536, "the generated classes end where the tree starts");
+#endif
+
+_Static_assert(ALIGNMENT>=16 && ALIGNMENT<=256 && (ALIGNMENT&(ALIGNMENT-1))==0, "ALIGNMENT is a power of 2 from 16 to 256");
+
+/* Events counted for mm_stats() in builds with MM_STATS */
+enum event{
+    stat_malloc, stat_free, stat_extend, stat_split, stat_coalesce, stat_search, stat_scan, stat_map, stat_events
+};
+
+/* List links are stored as 32 bit offsets from the start of the heap in units of 16 bytes, so a node fits in 
+the 8 bytes that follow the header of a minimum block. This limits the heap to max_heap (64GiB). */
 typedef struct node* Node;
 struct node{
-    Node prev, next;
+    uint32_t prev, next;
 };
 
-void* head[maxindex];
+/* Free blocks of 64KiB and above (treeindex) are kept in an AVL tree ordered by size and then by address */
+typedef struct tree* Tree;
+struct tree{
+    Tree left, right;
+    size_t height;
+};
+
+/* Requests of up to slab_limit bytes are served from runs: run_size aligned pages that hold slots of a single size class. 
+A run is itself an allocated block of the heap whose payload starts on a page, the last 8 bytes of the page hold the next header. Slots carry no header, free slots are linked by their slot number 
+(0 ends the list) and slots above bump have never been used. */
+typedef struct run* Run;
+struct run{
+    uint32_t prev, next;
+    uint16_t cls, used, free, bump;
+#ifdef MM_HARDEN
+    uint64_t live[4];   //a bit per slot number, set while the slot is handed out
+#endif
+};
+
+/* An arena bumps a pointer through chunks, which are blocks of the heap from malloc() listed newest first. Its objects 
+have no headers and are only given back all at once. Chunks double from arena_chunk up to arena_max, an object of more 
+than a quarter of the next chunk gets a chunk of its own so the current chunk keeps its room. */
+typedef struct chunk* Chunk;
+struct chunk{
+    Chunk next;
+    size_t size;
+};
+typedef struct mm_arena* Arena;
+struct mm_arena{
+    Chunk chunks, current;
+    char *bump, *end;
+    size_t next_size;
+};
+
+/* The list heads live at the start of the heap rather than in global memory. 
+Bit i of bitmap is set exactly when head[i] is non-empty, bit treeindex when the tree is non-empty. 
+runs[cls] lists the runs of a class that have free slots and bit p of pagemap is set when page p of the heap is a run. 
+quick[i] is a LIFO bin of freed blocks of exactly 16*(i+1) bytes whose coalescing has been deferred, deferred counts them. */
+typedef struct control* Control;
+struct control{
+    uint64_t bitmap;
+    Tree root;
+    Node head[maxindex];
+    uint32_t runs[slab_classes];
+    uint64_t* pagemap;
+    size_t mapped_pages;
+    uint32_t quick[quick_limit>>4];
+    size_t deferred;
+#ifdef MM_THREADS
+    pthread_mutex_t lock;
+#endif
+};
+
+Control ctrl;
+/* trim_limit and punch_limit start at trim_threshold and punch_threshold and double whenever memory given back is needed 
+again, trimmed is set from a trim until the heap next grows. They are guarded by the heap lock and kept out of the control 
+block, whose size decides where the first runs land. */
+static struct{
+    size_t trim_limit, punch_limit;
+    bool trimmed;
+} giveback;
+#ifdef MM_STATS
+/* The counters of mm_stats(), kept out of the control block so that stats builds lay out the same heap as release 
+builds. Stats builds only, so the globals do not count. */
+static size_t events[stat_events];
+#endif
+#ifdef MM_HARDEN
+/* The key of the header checksums, drawn by mm_init(). It is kept out of the control block so that hardened heaps 
+have the same layout as plain ones. */
+static size_t key;
+#endif
+
+#ifdef DEBUG
+/* mm_checkheap() mode, read from MM_CHECK by mm_init(): "full" (the default) walks the whole heap on every call, 
+"local" only checks the block last touched by allocate() or free_hf() and its neighbours, and a number N walks 
+the whole heap on every Nth call and checks locally in between. Debug builds only, so the globals do not count. */
+static size_t check_every;
+static size_t check_calls;
+static void* last_block;
+#endif
+
+#ifdef MM_THREADS
+/* With MM_THREADS every thread keeps up to cache_max free slots of each class, chained through their first 8 bytes, 
+so most small requests never take the heap lock. The cache is itself a block of the heap. 
+A cache belongs to the heap generation it was made in, the driver reinitializes the heap between traces. */
+typedef struct cache* Cache;
+struct cache{
+    void* slot[slab_classes];
+    uint32_t count[slab_classes];
+};
+static __thread Cache cache;
+static __thread size_t cache_gen;
+static size_t generation;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once=PTHREAD_ONCE_INIT;
+#ifndef DRIVER
+static pthread_once_t heap_once=PTHREAD_ONCE_INIT;
+#endif
+#endif
 
 /* Initially empty lists must have NULL heads */
 void head_init(){
+    ctrl->bitmap=0;
+    ctrl->root=NULL;
     for(size_t index=0;index<maxindex;index++){
-        head[index]=NULL; 
+        ctrl->head[index]=NULL; 
+    }
+    for(size_t cls=0;cls<slab_classes;cls++){
+        ctrl->runs[cls]=0;
+    }
+    ctrl->pagemap=NULL;
+    ctrl->mapped_pages=0;
+    for(size_t index=0;index<(quick_limit>>4);index++){
+        ctrl->quick[index]=0;
+    }
+    ctrl->deferred=0;
+    giveback.trim_limit=trim_threshold;
+    giveback.punch_limit=punch_threshold;
+    giveback.trimmed=false;
+#ifdef MM_STATS
+    for(int event=0;event<stat_events;event++){
+        events[event]=0;
     }
+#endif
     return;
 }
-/* Retrieve the appropriate list based on size */
+/* Retrieve the appropriate list based on size. Sizes below exact_limit get one list per 16 bytes, 
+larger sizes are split by their highest set bit and then into 2^sub_bits sub-lists (as in TLSF). 
+A build with SIZE_CLASSES takes the lists below the tree from the table made by mdriver -G instead. 
+Every block in list i is at least as big as the smallest size mapped to list i. */
 int get_index(size_t size){
+#ifdef SIZE_CLASSES
+    return size<class_tree?class_index[size>>4]:treeindex;
+#endif
+    if(size<exact_limit) return (int)(size>>4)-1;
 
-    if(size<=32) return 0;
-    if(size<=48) return 1;
-    if(size<=64) return 2;
-    if(size<=96) return 3;
-    if(size<=128) return 4;
-    if(size<=256) return 5;
-    if(size<=512) return 6;
-    if(size<=1024) return 7;
-    if(size<=2048) return 8;
-    if(size<=4096) return 9;
-    if(size<=8192) return 10;
-    if(size<=16384) return 11;
-    if(size<=65536) return 12;
-    if(size<=131072) return 13;
-    if(size<=262144) return 14;
-    // if(size<=524288) return 14;
-    else return 15;
+    int fl=63-__builtin_clzll(size);
+    int sl=(int)(size>>(fl-sub_bits)) & ((1<<sub_bits)-1);
+    int index=(exact_limit>>4)-1+((fl-__builtin_ctzll(exact_limit))<<sub_bits)+sl;
+    return index<maxindex?index:maxindex-1;
 }
 static size_t align(size_t x)
 {
@@ -122,11 +304,30 @@ void* decr(void* ptr, size_t size)
     dbg_assert(in_heap(ptr));
     return ptr;
 }
-/* Retrieves the 16 byte aligned block size by masking out the last 4 bits*/
+/* The prologue header follows the control block and a pad that aligns the first payload */
+void* prologue()
+{
+    return incr(ctrl, align(sizeof(struct control))+ALIGNMENT-w);
+}
+/* Everything but the thread caches is shared, with MM_THREADS it is only touched while holding the heap lock */
+void heap_lock()
+{
+#ifdef MM_THREADS
+    pthread_mutex_lock(&ctrl->lock);
+#endif
+}
+void heap_unlock()
+{
+#ifdef MM_THREADS
+    pthread_mutex_unlock(&ctrl->lock);
+#endif
+}
+/* Retrieves the ALIGNMENT aligned block size by masking out the bits below it, the last 4 of which hold the flags, 
+and with MM_HARDEN the checksum above size_mask */
 size_t get_size(void* ptr)
 {
   size_t val=*(size_t*)ptr;
-  size_t s=val & ~0xf;
+  size_t s=val & ~(size_t)(ALIGNMENT-1) & size_mask;
   
   return s;
 }
@@ -134,6 +335,10 @@ int diff(void* ptr1, void* ptr2)
 {
     return (int)((char*)ptr1-(char*)ptr2);
 }
+size_t diff_long(void* ptr1, void* ptr2)
+{
+    return (size_t)((char*)ptr1-(char*)ptr2);
+}
 
 
 void* get_f(void* ptr){
@@ -141,43 +346,60 @@ void* get_f(void* ptr){
     dbg_assert(in_heap(incr(ptr, block_size-w)));
     return incr(ptr, block_size-w);
 }
-void* get_h(void* ptr){
-    size_t block_size=get_size(ptr);
-    dbg_assert(in_heap(decr(ptr, block_size-w)));
-    return decr(ptr, block_size-w);
-}
 
-/* To get/free/set the allocation status of the preceding block by manipulating the 2nd least significant bit*/
+/* To get the allocation status of the preceding block from the 2nd least significant bit*/
 int get_prev_alloc(void* ptr){
     size_t val=*(size_t*)ptr;
     // int prev_alloc=((int)(val & 0x2))?1:0;
     int prev_alloc=(val >> 1) & 1;
     return prev_alloc;
 }
-size_t free_prev_alloc(void* ptr)
-{
-    
+/* The 3rd least significant bit is set when the preceding block is a minimum block. 
+Free 16 byte blocks have no room for a footer, and no minimum block gets one, so this is the only way to find their header. */
+int get_prev_mini(void* ptr){
     size_t val=*(size_t*)ptr;
-    dbg_assert(get_prev_alloc(ptr)==1);
-    size_t s=val & ~0x2;
-    *(size_t*)ptr=s;
-    dbg_assert(get_prev_alloc(ptr)==0);
-    return s;
+    return (val >> 2) & 1;
 }
-size_t set_prev_alloc(void* ptr)
-{
-    
+int is_alloc(void* ptr){
+    return (size_t)(*(size_t*)ptr%2);
+}
+/* The 4th least significant bit marks a block sitting in a quick bin. It keeps its alloc bit so no neighbour coalesces with it */
+int is_deferred(void* ptr){
     size_t val=*(size_t*)ptr;
-    dbg_assert(get_prev_alloc(ptr)==0);
-    size_t s=val | 0x2;
-    *(size_t*)ptr=s;
-    dbg_assert(get_prev_alloc(ptr)==1);
-    return s;
+    return (val >> 3) & 1;
 }
 /* Note the function parameters which comprise the header*/
-void* make_h(void* ptr, size_t size, int prev_alloc, int alloc)
+/* Counts n events for mm_stats(). Without MM_STATS the body is empty and every call is inlined away. */
+void count(enum event event, size_t n)
 {
-    size_t val=size | alloc | prev_alloc<<1;
+#ifdef MM_STATS
+#ifdef MM_THREADS
+    __atomic_fetch_add(&events[event], n, __ATOMIC_RELAXED);
+#else
+    events[event]+=n;
+#endif
+#endif
+}
+/* Records the header of the block an operation changed last, for the local checks of mm_checkheap() */
+void touch(void* ptr)
+{
+#ifdef DEBUG
+    last_block=ptr;
+#endif
+}
+/* With MM_HARDEN the bits of a header above size_mask hold a checksum of its address and size keyed per heap, 
+the flags are left out since neighbours change them. Without it the checksum is 0 and make_h() is unchanged. */
+size_t seal(void* ptr, size_t size)
+{
+#ifdef MM_HARDEN
+    return ((size_t)ptr ^ size ^ key)*0x9e3779b97f4a7c15 & ~size_mask;
+#else
+    return 0;
+#endif
+}
+void* make_h(void* ptr, size_t size, int prev_mini, int prev_alloc, int alloc)
+{
+    size_t val=size | alloc | prev_alloc<<1 | prev_mini<<2 | seal(ptr, size);
     *(size_t*)ptr=val;
     return ptr;
 }
@@ -187,26 +409,33 @@ void* make_f(void* ptr, size_t size, int alloc)
     *(size_t*)ptr=val;
     return ptr;
 }
-void* make_hf(void* ptr, size_t size, int prev_alloc, int alloc)
+void* make_hf(void* ptr, size_t size, int prev_mini, int prev_alloc, int alloc)
 {
-    make_h(ptr, size, prev_alloc, alloc);
+    make_h(ptr, size, prev_mini, prev_alloc, alloc);
     make_f(get_f(ptr), size, alloc);
     return ptr;
 }
 void* make_epi(void* ptr)
 {
-    make_h(ptr, 0, 1, 1);
+    make_h(ptr, 0, 0, 1, 1);
     return ptr;
 }
+/* The prev_alloc and prev_mini bits of the following block are updated whenever a block changes its size or status */
+void* link_next(void* ptr)
+{
+    size_t block_size=get_size(ptr);
+    void* next_header=incr(ptr, block_size);
+    size_t val=*(size_t*)next_header & ~(size_t)0x6;
+    val|=(size_t)is_alloc(ptr)<<1 | (size_t)(block_size==min_block)<<2;
+    *(size_t*)next_header=val;
+    return next_header;
+}
 void* free_h(void* ptr)
 {
     size_t val=*(size_t*)ptr & ~0x1;
     *(size_t*)ptr=val;
     return ptr;
 }
-int is_alloc(void* ptr){
-    return (size_t)(*(size_t*)ptr%2);
-}
 /* To retrieve the corresponding node/header for a block */
 void* n2h(void* ptr){
     return decr(ptr, w);
@@ -214,17 +443,60 @@ void* n2h(void* ptr){
 void* h2n(void* ptr){
     return incr(ptr, w);
 }
+
+/* Hardened builds stop at the first sign of a damaged heap, before a bad header or link is followed */
+void corrupt(const char* what, void* ptr)
+{
+    fprintf(stderr, "mm: %s: %p\n", what, ptr);
+    abort();
+}
+/* With MM_HARDEN a block handed to free() or realloc() must have an intact header that says it is allocated and not 
+deferred, and a heap block must be followed by an intact header whose prev_alloc bit agrees. Catches double frees, 
+pointers that are not blocks and overflows into the next header. */
+void check_block(void* ptr)
+{
+#ifdef MM_HARDEN
+    void* header=(char*)ptr-w;
+    size_t size=get_size(header);
+    if(!aligned(ptr) || (*(size_t*)header & ~size_mask)!=seal(header, size)) corrupt("invalid pointer or corrupted header", ptr);
+    if(!is_alloc(header) || is_deferred(header)) corrupt("double free", ptr);
+    if(!in_heap(ptr)) return;
+    void* next=(char*)header+size;
+    if((*(size_t*)next & ~size_mask)!=seal(next, get_size(next))) corrupt("corrupted next header", ptr);
+    if(!get_prev_alloc(next)) corrupt("double free", ptr);
+#endif
+}
+/* Freed blocks drop their alloc bit at once, so a header that ends up inside a coalesced block still reads as free */
+void retire(void* ptr)
+{
+#ifdef MM_HARDEN
+    free_h(ptr);
+#endif
+}
+/* To convert between nodes and the compressed links stored inside them, 0 stands for NULL */
+Node to_node(uint32_t offset){
+    return offset==0?NULL:(Node)incr(ctrl, (size_t)offset<<4);
+}
+uint32_t to_offset(Node x){
+    return x==NULL?0:(uint32_t)(diff_long(x, ctrl)>>4);
+}
+Node next_node(Node x){
+    return to_node(x->next);
+}
+Node prev_node(Node x){
+    return to_node(x->prev);
+}
 bool printlist(int line_number)
 {
 #ifdef PRINT
     for (int index=0;index<maxindex;index++){
-        if(head[index]!=NULL){
-            Node x=head[index];
-            dbg_printf("List %p:\n", head[index]);
+        if(ctrl->head[index]!=NULL){
+            Node x=ctrl->head[index];
+            dbg_printf("List %p:\n", ctrl->head[index]);
             do{
-                dbg_printf("%p, %p, %p, %zu\n", x, x->prev,x->next, get_size(n2h(x)));
-                x=x->next;
-            }while(x!=head[index]);
+                dbg_printf("%p, %p, %p, %zu\n", x, prev_node(x), next_node(x), get_size(n2h(x)));
+                x=next_node(x);
+            }while(x!=ctrl->head[index]);
             dbg_printf("end of heap:%p\n", mm_heap_hi());
         }
     }
@@ -235,8 +507,7 @@ bool printlist(int line_number)
 bool printheap(int line_number)
 {
 #ifdef PRINT
-    void* ptr=mm_heap_lo();
-    ptr=incr(ptr, w); 
+    void* ptr=prologue();
     size_t block_size=get_size(ptr);
     dbg_printf("Heap:\n");
     while(block_size!=0)
@@ -250,21 +521,110 @@ bool printheap(int line_number)
     return true;
 }
 
-/* To check if a node ptr is part of the list. 
-This can be called in the heap consistency checker to verify that all free blocks are also present as nodes */
-bool check_presence(void* ptr, int index){
-    if(head[index]!=NULL){
-        Node x=head[index];
-        do{
-            if (x==ptr){
-                return true;
-            }
-            x=x->next;
-        }while(x!=head[index]); 
+/* The AVL tree stores the largest free blocks so that the best fit can be found in O(log n) time. 
+The address breaks ties between equal sizes, so every block has a unique key. */
+size_t height(Tree t)
+{
+    return t==NULL?0:t->height;
+}
+void update_height(Tree t)
+{
+    size_t l=height(t->left), r=height(t->right);
+    t->height=1+(l>r?l:r);
+}
+bool tree_before(Tree a, Tree b)
+{
+    size_t a_size=get_size(n2h(a)), b_size=get_size(n2h(b));
+    return a_size<b_size || (a_size==b_size && a<b);
+}
+Tree rotate_right(Tree t)
+{
+    Tree l=t->left;
+    t->left=l->right;
+    l->right=t;
+    update_height(t);
+    update_height(l);
+    return l;
+}
+Tree rotate_left(Tree t)
+{
+    Tree r=t->right;
+    t->right=r->left;
+    r->left=t;
+    update_height(t);
+    update_height(r);
+    return r;
+}
+/* Restores the AVL property at t after one of its subtrees changed height by at most 1 */
+Tree rebalance(Tree t)
+{
+    update_height(t);
+    if(height(t->left)>height(t->right)+1){
+        if(height(t->left->left)<height(t->left->right)) t->left=rotate_left(t->left);
+        return rotate_right(t);
     }
-    return false;
+    if(height(t->right)>height(t->left)+1){
+        if(height(t->right->right)<height(t->right->left)) t->right=rotate_right(t->right);
+        return rotate_left(t);
+    }
+    return t;
+}
+Tree insert_tree(Tree t, Tree newnode)
+{
+    if(t==NULL){
+        newnode->left=newnode->right=NULL;
+        newnode->height=1;
+        return newnode;
+    }
+    if(tree_before(newnode, t)) t->left=insert_tree(t->left, newnode);
+    else t->right=insert_tree(t->right, newnode);
+    return rebalance(t);
+}
+Tree remove_min(Tree t, Tree* min)
+{
+    if(t->left==NULL){
+        *min=t;
+        return t->right;
+    }
+    t->left=remove_min(t->left, min);
+    return rebalance(t);
+}
+Tree remove_tree(Tree t, Tree freeblock)
+{
+    dbg_assert(t!=NULL);
+    if(t==freeblock){
+        //The successor of the removed node takes its place
+        Tree succ;
+        if(t->right==NULL) return t->left;
+        Tree right=remove_min(t->right, &succ);
+        succ->left=t->left;
+        succ->right=right;
+        return rebalance(succ);
+    }
+    if(tree_before(freeblock, t)) t->left=remove_tree(t->left, freeblock);
+    else t->right=remove_tree(t->right, freeblock);
+    return rebalance(t);
+}
+/* Returns the smallest block of size>=block_size, the lowest address wins among equal sizes */
+Tree fit_tree(size_t block_size)
+{
+    Tree t=ctrl->root, best=NULL;
+    while(t!=NULL){
+        if(get_size(n2h(t))>=block_size){
+            best=t;
+            t=t->left;
+        }
+        else t=t->right;
+    }
+    return best;
 }
 
+/* With sorted_bins the lists that hold a range of sizes are kept in ascending order, the exact size lists need not be. 
+It is off because the sorted insertions cost more time than the better fits save space on the default traces. */
+bool is_sorted(int index)
+{
+    return sorted_bins && index>=get_index(exact_limit) && index!=treeindex;
+}
 void addnode(void* ptr)
 {
     dbg_printf("Add Node %p\n", ptr);
@@ -273,21 +633,32 @@ void addnode(void* ptr)
     Node newnode=ptr;
     size_t size=get_size(n2h(ptr));
     int index=get_index(size);
+
+    if(index==treeindex){
+        ctrl->root=insert_tree(ctrl->root, ptr);
+        ctrl->bitmap|=(uint64_t)1<<index;
+        return;
+    }
     
     //The first node in list points to itself
-    if(head[index]==NULL){
-        head[index]=newnode;
-        newnode->next = (newnode->prev = newnode);
+    if(ctrl->head[index]==NULL){
+        ctrl->head[index]=newnode;
+        ctrl->bitmap|=(uint64_t)1<<index;
+        newnode->next = (newnode->prev = to_offset(newnode));
         return;
     }
-    //Insertion at the front requires O(1) time
-    else{
-        Node first=head[index];
-        newnode->prev=first->prev;
-        newnode->next=first;
-        first->prev->next=newnode;
-        first->prev=newnode;
+    //New nodes go in before the head, which is the tail of the circular list, in O(1) time
+    Node first=ctrl->head[index];
+    Node next=first;
+    //Sorted lists keep their smallest block at the head, so only blocks smaller than the tail need a scan
+    if(is_sorted(index) && size<get_size(n2h(prev_node(first)))){
+        while(get_size(n2h(next))<size) next=next_node(next);
+        if(next==first) ctrl->head[index]=newnode;
     }
+    newnode->prev=next->prev;
+    newnode->next=to_offset(next);
+    prev_node(next)->next=to_offset(newnode);
+    next->prev=to_offset(newnode);
     // printlist(__LINE__);
     return;
 }
@@ -296,194 +667,360 @@ void removenode(void* ptr, int index)
 {
     dbg_printf("Remove Node %p\n", ptr);
     Node freeblock=ptr;
-    dbg_assert(head[index]!=NULL);
     dbg_assert(in_heap(ptr));
+    if(index==treeindex){
+        ctrl->root=remove_tree(ctrl->root, ptr);
+        if(ctrl->root==NULL) ctrl->bitmap&=~((uint64_t)1<<index);
+        return;
+    }
+    dbg_assert(ctrl->head[index]!=NULL);
+#ifdef MM_HARDEN
+    //Safe unlinking, the neighbours must point back at the node
+    if(prev_node(freeblock)->next!=to_offset(freeblock) || next_node(freeblock)->prev!=to_offset(freeblock)){
+        corrupt("corrupted free list", ptr);
+    }
+#endif
     //Removing the only node in a list also means removing the head
-    if(freeblock==freeblock->next && head[index]==freeblock){  
+    if(freeblock==next_node(freeblock) && ctrl->head[index]==freeblock){  
         dbg_printf("Only one\n");
-        head[index]=NULL;
+        ctrl->head[index]=NULL;
+        ctrl->bitmap&=~((uint64_t)1<<index);
         return;
     }
     //In a circular doubly linked list, any node can be the new head
-    if(head[index]==freeblock){ 
-        head[index]=freeblock->next;
+    if(ctrl->head[index]==freeblock){ 
+        ctrl->head[index]=next_node(freeblock);
     }
-    freeblock->prev->next=freeblock->next;
-    freeblock->next->prev=freeblock->prev;
+    prev_node(freeblock)->next=freeblock->next;
+    next_node(freeblock)->prev=freeblock->prev;
     return;
 }
-/* To coalesce neighboring free blocks, their allocation status and sizes are computed and the previous footer and the next header 
+/* Pages of a big free block between its links and its footer hold nothing, so [lo, hi) of them are given back to the OS */
+void punch(void* ptr, char* lo, char* hi)
+{
+    char* first=(char*)ptr+w+sizeof(struct tree);
+    char* last=(char*)get_f(ptr);
+    if(lo<first) lo=first;
+    if(hi>last) hi=last;
+    if(hi>lo) mm_release(lo, (size_t)(hi-lo));
+}
+/* To coalesce neighboring free blocks, their allocation status and sizes are computed and the previous header and the next header 
 are obtained accordingly. The node corresponding to each free block is removed from its list and the coalesced free block is added
 back to the appropriate list.*/
 void* free_hf(void* ptr)
 {
-    dbg_printf("free_hf starts: %p, %p\n", ptr, get_f(ptr));
+    dbg_printf("free_hf starts: %p, %zu\n", ptr, get_size(ptr));
     dbg_printf("heap hi: %p\n", mm_heap_hi());
+    retire(ptr);
      
-    //The prev_footer and the next_header are used to manipulate the neighboring blocks
-    //Note the prev_footer will not exist if the previous block is allocated.
-    void* prev_footer=decr(ptr,w);
-    void* next_header=incr(get_f(ptr),w);
+    //The prev_header and the next_header are used to manipulate the neighboring blocks
+    void* next_header=incr(ptr,get_size(ptr));
 
     //To coalesce neighboring free blocks, their allocation status and sizes are computed
     int prev=get_prev_alloc(ptr);
     int next=is_alloc(next_header);
 
-    dbg_assert(in_heap(prev_footer));
     dbg_assert(in_heap(next_header));
 
     size_t curr_size=get_size(ptr);
-    size_t prev_size=get_size(prev_footer);
     size_t next_size=get_size(next_header);
     size_t size;
+    char* lo=ptr;
+    char* hi=(char*)next_header;
 
-    int prev_index=get_index(prev_size);
-    int next_index=get_index(next_size);
+    //Note the previous footer will not exist if the previous block is allocated or is a minimum block.
+    size_t prev_size=0;
+    if(prev==0){
+        prev_size=get_prev_mini(ptr)?min_block:get_size(decr(ptr,w));
+    }
+    void* prev_header=decr(ptr,prev_size);
 
     //4 combinations of neighbours may exist
     if(prev==0 && next==0){
         dbg_printf("\n\nBoth Free\n\n");
-        void* prev_header=get_h(prev_footer);
-        void* prev_node=h2n(prev_header);
-        void* next_node=h2n(next_header);
-        removenode(prev_node, prev_index);
+        removenode(h2n(prev_header), get_index(prev_size));
         dbg_printf("Between removenodes\n");
         printheap(__LINE__);
-        removenode(next_node, next_index);
+        removenode(h2n(next_header), get_index(next_size));
         size=curr_size+prev_size+next_size;
-        make_h(prev_header, size, get_prev_alloc(prev_header), 0);
-        make_f(get_f(next_header), size, 0);
-        ptr=get_h(prev_footer);
-
+        ptr=prev_header;
     }
     else if(prev==0 && next==1){
-        void* prev_node=h2n(get_h(prev_footer));
-        removenode(prev_node, prev_index);
+        removenode(h2n(prev_header), get_index(prev_size));
         size=curr_size+prev_size;
-        make_h(get_h(prev_footer), size, get_prev_alloc(get_h(prev_footer)), 0);
-        make_f(get_f(ptr),size,0);
-        free_prev_alloc(next_header);
-        ptr=get_h(prev_footer);
-
+        ptr=prev_header;
     }
     else if(prev==1 && next==0){
-        void* next_node=h2n(next_header);
-        removenode(next_node, next_index);
+        removenode(h2n(next_header), get_index(next_size));
         size=curr_size+next_size;
-        make_h(ptr, size, 1, 0);
-        make_f(get_f(next_header),size,0);
-
     }
     else{
-        size=curr_size+0*next_index+0*prev_index*next*prev;
-        dbg_assert(size>0);
-        make_h(ptr, size, 1, 0);
-        make_f(get_f(ptr),size,0);
-        free_prev_alloc(incr(get_f(ptr),w));
-
+        size=curr_size;
     }
+    dbg_assert(size>0);
+    count(stat_coalesce, (prev==0)+(next==0));
+
+    //The previous block of a free block is always allocated after coalescing
+    make_h(ptr, size, get_prev_mini(ptr), 1, 0);
+    if(size>min_block) make_f(get_f(ptr), size, 0);
+    link_next(ptr);
     
+    //Neighbours of at least punch_limit bytes have been punched already, only the rest of the block needs it
+    if(size>=giveback.punch_limit){
+        if(prev==1 || prev_size<giveback.punch_limit) lo=ptr;
+        if(next==1 || next_size<giveback.punch_limit) hi=(char*)incr(ptr, size);
+        punch(ptr, lo, hi);
+    }
+    touch(ptr);
     ptr=h2n(ptr);
     addnode(ptr);
     return ptr;
 }
 
+/* Freed blocks of up to quick_limit bytes are pushed onto the bin for their exact size with the alloc bit left set. 
+Once more than quick_max blocks are waiting they are all coalesced at once. */
+void defer(void* ptr)
+{
+    size_t index=(get_size(ptr)>>4)-1;
+    *(size_t*)ptr|=0x8;
+    Node x=h2n(ptr);
+    x->next=ctrl->quick[index];
+    ctrl->quick[index]=to_offset(x);
+    ctrl->deferred++;
+}
+/* Pops a deferred block of exactly block_size bytes, it is handed out again as it is */
+void* quick_pop(size_t block_size)
+{
+    size_t index=(block_size>>4)-1;
+    Node x=to_node(ctrl->quick[index]);
+    if(x==NULL) return NULL;
+#ifdef MM_HARDEN
+    if(!is_deferred(n2h(x)) || get_size(n2h(x))!=block_size) corrupt("corrupted quick bin", x);
+#endif
+    ctrl->quick[index]=x->next;
+    ctrl->deferred--;
+    *(size_t*)n2h(x)&=~(size_t)0x8;
+    return x;
+}
+/* Empties every bin through free_hf(), a block already merged into a neighbour is never revisited since bins hold whole blocks */
+void flush()
+{
+    for(size_t index=0;index<(quick_limit>>4) && ctrl->deferred!=0;index++){
+        Node x;
+        while((x=quick_pop((index+1)<<4))!=NULL){
+            free_hf(n2h(x));
+        }
+    }
+    dbg_assert(ctrl->deferred==0);
+}
+
+#ifdef MM_THREADS
+void release_cache(void* ptr);
+void make_key()
+{
+    pthread_key_create(&cache_key, release_cache);
+}
+#ifndef DRIVER
+void start_heap()
+{
+    mem_init();
+    mm_init();
+}
+#endif
+#endif
+
+/* Interposed builds have no driver to set the heap up, so the first call into the allocator does it */
+void startup()
+{
+#ifndef DRIVER
+#ifdef MM_THREADS
+    pthread_once(&heap_once, start_heap);
+#else
+    if(ctrl==NULL){
+        mem_init();
+        mm_init();
+    }
+#endif
+#endif
+}
+
 /* Execution starts from here and the heap is expanded for the first time to create the prologue and epilogue */
 bool mm_init(void)
 {
     
-    //create prologue epilogue
-    void* ptr=mm_sbrk(align(4*w)); 
+    //create the control block, prologue and epilogue
+    void* ptr=mm_sbrk(align(sizeof(struct control))+2*ALIGNMENT); 
+    if(ptr==(void*)-1) return false;
     dbg_assert(aligned(ptr));
 
+    ctrl=ptr;
     head_init();
-    make_hf(incr(ptr,8), 2*w, 0, 1);
-    make_epi(incr(ptr, 3*w));
-    if(ptr==NULL) return false;
+#ifdef MM_HARDEN
+    //A key that cannot be read leaves the checksums to the layout of the address space
+    if(getentropy(&key, sizeof(key))!=0) key=(size_t)ctrl ^ (size_t)&ptr;
+#endif
+#ifdef DEBUG
+    const char* mode=getenv("MM_CHECK");
+    check_every=mode==NULL || strcmp(mode, "full")==0?1:strcmp(mode, "local")==0?0:strtoul(mode, NULL, 10);
+    check_calls=0;
+    last_block=NULL;
+#endif
+#ifdef MM_THREADS
+    pthread_once(&cache_once, make_key);
+    pthread_mutex_init(&ctrl->lock, NULL);
+    generation++;
+#endif
+    ptr=prologue();
+    make_hf(ptr, min_block, 0, 0, 1);
+    make_epi(incr(ptr, min_block));
+    link_next(ptr);
 
     return true; 
 }
 
-/* Free nodes bigger than the user's requirments are split only if this produces a free node greater than 32 bytes. 
+/* Free nodes bigger than the user's requirments are split only if this produces a free node of at least min_block bytes. 
 This is the minimum size a free node can have. The freenode is then added to the appropriate list. */
 void* allocate(void* ptr, size_t block_size){
 
-    //Free nodes bigger than the user's requirments are split only if this produces a free node greater than 32 bytes. 
+    //Free nodes bigger than the user's requirments are split only if this produces a free node of at least min_block bytes. 
     //This is the minimum size a free node can have.
     size_t total_size=get_size(ptr);
     size_t newblock_size=total_size-block_size;
 
-    if (newblock_size>=4*w){
+    if (newblock_size>=min_block){
         void* end_hptr=incr(ptr,block_size);
-        void* end_fptr=get_f(ptr);
         
-        make_h(ptr, block_size, get_prev_alloc(ptr), 1);
+        make_h(ptr, block_size, get_prev_mini(ptr), get_prev_alloc(ptr), 1);
 
-        make_h(end_hptr, newblock_size, 1, 0);
-        make_f(end_fptr, newblock_size, 0);
+        make_h(end_hptr, newblock_size, block_size==min_block, 1, 0);
+        if(newblock_size>min_block) make_f(get_f(end_hptr), newblock_size, 0);
+        link_next(end_hptr);
         //The new free node created, is then added to the appropriate list.
         addnode(h2n(end_hptr));
+        count(stat_split, 1);
         
-        dbg_assert(get_f(end_hptr)==end_fptr);
-        dbg_assert(newblock_size==get_size(get_f(end_hptr)));
+        dbg_assert(newblock_size==min_block || newblock_size==get_size(get_f(end_hptr)));
     }
     else{
         //If the node is not too big, give it directly to the user
-        make_h(ptr, total_size, get_prev_alloc(ptr), 1);        
-        set_prev_alloc(incr(ptr, total_size));
+        make_h(ptr, total_size, get_prev_mini(ptr), get_prev_alloc(ptr), 1);        
+        link_next(ptr);
     }
+    touch(ptr);
     ptr=incr(ptr, w);
     dbg_assert(aligned(ptr));
     return ptr;
 }
 
 /* Iterate over the list to obtain a free block of size>=block_size
-The commented out code finds the best-of-k free blocks to maximize utilization at the expense of throughput */
+Only the list that block_size maps to has to be searched, every block in a higher non-empty list is big enough and 
+the first such list is found from the bitmap. Blocks in the tree are always chosen by best fit. */
 void* get_freeblock(size_t block_size){
     int index=get_index(block_size);
-    // void* best=NULL; int best_index;
-    // int k=0;
-    for (int i=index;i<maxindex;i++){
-        if(head[i]!=NULL){
-            Node x=head[i];
-            do{
-                void* header=n2h(x);
-                dbg_assert(in_heap(header));
-                dbg_assert(in_heap(x));
-                if(get_size(header)>=block_size){
-                    // if(best==NULL ||get_size(header)<get_size(best)) {
-                    //     best=header;
-                    //     best_index=i;
-                    //     k++;
-                    //     if(k==4) break;
-                    // }
-                    removenode(x, i); //Comment out these 2 lines when finding the best-of-k blocks
-                    return x;             //
-                }
-                x=x->next;
-                
-            }while(x!=head[i]);
+    count(stat_search, 1);
+    //A sorted list whose largest block, the tail, is too small is skipped without a scan
+    if(index!=treeindex && ctrl->head[index]!=NULL
+       && (!is_sorted(index) || get_size(n2h(prev_node(ctrl->head[index])))>=block_size)){
+        Node x=ctrl->head[index];
+        do{
+            void* header=n2h(x);
+            dbg_assert(in_heap(header));
+            dbg_assert(in_heap(x));
+            count(stat_scan, 1);
+            if(get_size(header)>=block_size){
+                removenode(x, index);
+                return x;
+            }
+            x=next_node(x);
+            
+        }while(x!=ctrl->head[index]);
+    }
+
+    //Lists above index are masked in and the lowest non-empty one is picked with a single instruction
+    uint64_t usable=ctrl->bitmap & ~(((uint64_t)2<<index)-1);
+    if(index==treeindex) usable=ctrl->bitmap & ((uint64_t)1<<treeindex);
+    if(usable!=0){
+        int i=__builtin_ctzll(usable);
+        //The tree may hold only blocks that are too small, which is a miss like an empty list
+        void* x=(i==treeindex)?(void*)fit_tree(block_size):(void*)ctrl->head[i];
+        if(x!=NULL){
+            dbg_assert(get_size(n2h(x))>=block_size);
+            removenode(x, i);
+            //Reusing a punched block faults its pages back in, so punching gets less eager
+            if(get_size(n2h(x))>=giveback.punch_limit && giveback.punch_limit<max_heap) giveback.punch_limit*=2;
+            return x;
         }
-        // if(best!=NULL) break;
     }
-    // if(best!=NULL){
-    //     removenode(h2n(best), best_index);
-    //     return h2n(best);
-    // }
 
+    //A miss coalesces the deferred blocks before the heap is grown
+    if(ctrl->deferred!=0){
+        flush();
+        return get_freeblock(block_size);
+    }
     return NULL;
 }
-/* Extending the heap also requires shifting the epilogue to the end of the heap */
+/* All growth of the heap goes through here. Links are 32 bit offsets, so the heap cannot grow beyond max_heap */
+bool grow_heap(size_t size)
+{
+    //Subtracting cannot wrap, and a size that would turn negative as an increment is refused before mm_sbrk() shrinks by it
+    if(size>max_heap-mm_heapsize() || size>PTRDIFF_MAX || mm_sbrk((intptr_t)size)==(void*)-1) return false;
+    //Growing back over trimmed memory means trimming is too eager for this program, as with glibc's dynamic thresholds
+    if(giveback.trimmed){
+        giveback.trim_limit*=2;
+        giveback.trimmed=false;
+    }
+    return true;
+}
+
+/* The free block that ends at the epilogue, or the epilogue itself, is where the heap grows from */
+void* heap_top()
+{
+    void* epilogue=decr(mm_heap_hi(), w-1);
+    if(get_prev_alloc(epilogue)) return epilogue;
+    return decr(epilogue, get_prev_mini(epilogue)?min_block:get_size(decr(epilogue, w)));
+}
+
+/* Extending the heap also requires shifting the epilogue to the end of the heap. A free block before the epilogue is 
+merged with the new memory so only the missing bytes are requested, and the heap grows by at least extend_chunk.
+Like get_freeblock() the node of a free block of at least block_size is returned, it is not in any list. */
 void* extend(size_t block_size)
 {
-    int prev_alloc=get_prev_alloc(decr(mm_heap_hi(), w-1));
-    void* new_ptr=mm_sbrk(block_size);
-    if(new_ptr){
-        
-        make_h(decr(new_ptr,w), block_size, prev_alloc, 1);
-        make_epi(incr(new_ptr,(block_size-w)));
+    count(stat_extend, 1);
+    void* epilogue=decr(mm_heap_hi(), w-1);
+    void* ptr=heap_top();
+    size_t have=diff_long(epilogue, ptr);
+    if(have!=0) removenode(h2n(ptr), get_index(have));
+
+    size_t need=block_size>have?block_size-have:0;
+    size_t grow=need<extend_chunk?extend_chunk:need;
+    if(grow>max_heap-mm_heapsize()) grow=need;
+    if(grow!=0 && !grow_heap(grow)){
+        if(have!=0) addnode(h2n(ptr));
+        return NULL;
+    }
+
+    size_t size=have+grow;
+    make_h(ptr, size, get_prev_mini(ptr), get_prev_alloc(ptr), 0);
+    make_epi(incr(ptr, size));
+    link_next(ptr);
+    return h2n(ptr);
+}
+
+/* A free block of more than trim_limit bytes at the top of the heap is given back by moving the break down */
+void trim()
+{
+    void* epilogue=decr(mm_heap_hi(), w-1);
+    void* ptr=heap_top();
+    size_t size=diff_long(epilogue, ptr);
+    if(size<=giveback.trim_limit) return;
+    removenode(h2n(ptr), get_index(size));
+    if(mm_sbrk(-(intptr_t)size)==(void*)-1){
+        addnode(h2n(ptr));
+        return;
     }
-    return new_ptr;
+    //The block before is allocated, the new epilogue keeps its prev_mini bit
+    make_h(ptr, 0, get_prev_mini(ptr), 1, 1);
+    giveback.trimmed=true;
 }
 
 /* finder returns the payload ptr */
@@ -497,41 +1034,451 @@ void* finder(void * ptr, size_t block_size)
     dbg_printf("Between remove and add:\n");
     printheap(__LINE__);
     printlist(__LINE__);
-    //If get_freeblock is successful, the new node must be processed before giving it to the user
-    if(freeblock!=NULL){
-        dbg_printf("Not null\n");
+    //If get_freeblock fails, a free node of the required size cannot be found and the heap must be extended
+    if(freeblock==NULL){
+        dbg_printf("null\n");
+        freeblock=extend(block_size);
+        if(freeblock==NULL) return NULL;
+    }
+    //The new node must be processed before giving it to the user
+    ptr=n2h(freeblock);
+    void* payload_ptr=allocate(ptr, block_size);
+    return payload_ptr;
+}
+/* Shrinking an allocated block splits off the tail following the same rule as allocate(), the tail is coalesced by free_hf() */
+void shrink(void* ptr, size_t block_size)
+{
+    size_t curr_size=get_size(ptr);
+    if(curr_size-block_size>=min_block){
+        void* tail=incr(ptr, block_size);
+        make_h(ptr, block_size, get_prev_mini(ptr), get_prev_alloc(ptr), 1);
+        make_h(tail, curr_size-block_size, block_size==min_block, 1, 1);
+        free_hf(tail);
+    }
+}
 
-        ptr=n2h(freeblock);
-        void* payload_ptr=allocate(ptr, block_size);
-        return payload_ptr;
+/* Returns the header of an allocated block whose payload is a multiple of alignment. A free block big enough to contain 
+such a payload is taken whole, or the heap is extended by enough to align the new payload. 
+The slack before and after the payload is freed again */
+void* place_aligned(size_t block_size, size_t alignment)
+{
+    void* freeblock=get_freeblock(block_size+alignment-ALIGNMENT);
+    if(freeblock==NULL){
+        //The extension starts at heap_top(), so the payload there decides how much slack is needed
+        size_t start=(size_t)heap_top()+w;
+        freeblock=extend((alignment-start%alignment)%alignment+block_size);
+        if(freeblock==NULL) return NULL;
+    }
+    void* payload_ptr=allocate(n2h(freeblock), get_size(n2h(freeblock)));
+    void* ptr=n2h(payload_ptr);
+    //Both addresses are ALIGNMENT aligned, so the leading slack is either 0 or a valid block
+    size_t lead=(alignment-(size_t)payload_ptr%alignment)%alignment;
+    if(lead!=0){
+        size_t total_size=get_size(ptr);
+        void* rest=incr(ptr, lead);
+        make_h(ptr, lead, get_prev_mini(ptr), get_prev_alloc(ptr), 1);
+        make_h(rest, total_size-lead, lead==min_block, 1, 1);
+        link_next(rest);
+        free_hf(ptr);
+        ptr=rest;
+    }
+    shrink(ptr, block_size);
+    return ptr;
+}
+
+/* Requests of map_threshold bytes and more get a region of their own from mm_mmap(). The region starts with a pad 
+and the header of an allocated block whose payload is ALIGNMENT bytes in, the block spans all of the region but its first 
+ALIGNMENT bytes, so get_size() of the header minus w never exceeds the payload, as for heap blocks. A region is unmapped as soon as its block is freed, and mm_mremap() grows it 
+without copying. Sizes above max_heap are refused before map_length() can wrap. */
+bool is_mapped(void* ptr)
+{
+    return !in_heap(ptr);
+}
+size_t map_length(size_t size)
+{
+    size_t page=mm_pagesize();
+    return (size+ALIGNMENT+w+page-1)/page*page;
+}
+//n2h() and h2n() assert that they stay in the heap, so mapped blocks are located directly
+size_t map_size(void* ptr)
+{
+    return get_size((char*)ptr-w)+ALIGNMENT;
+}
+void* map_block(void* region, size_t length)
+{
+    make_h((char*)region+ALIGNMENT-w, length-ALIGNMENT, 0, 1, 1);
+    return (char*)region+ALIGNMENT;
+}
+void* map_alloc(size_t size)
+{
+    if(size>max_heap) return NULL;
+    size_t length=map_length(size);
+    void* region=mm_mmap(length);
+    if(region==(void*)-1) return NULL;
+    count(stat_map, 1);
+    return map_block(region, length);
+}
+void map_free(void* ptr)
+{
+    mm_munmap((char*)ptr-ALIGNMENT, map_size(ptr));
+}
+void* map_resize(void* ptr, size_t size)
+{
+    if(size>max_heap) return NULL;
+    size_t length=map_length(size);
+    size_t old_length=map_size(ptr);
+    if(length==old_length) return ptr;
+    void* region=mm_mremap((char*)ptr-ALIGNMENT, old_length, length);
+    if(region==(void*)-1) return NULL;
+    return map_block(region, length);
+}
+
+/* Slab classes are 16 bytes apart up to 128 bytes, 32 bytes apart up to 256 and 64 bytes apart up to slab_limit. 
+Sizes are aligned first, so with a bigger ALIGNMENT only the classes that are multiples of it are used. */
+int slab_class(size_t size)
+{
+    size_t s=align(size);
+    if(s<=128) return s<=16?0:(int)(s>>4)-1;
+    if(s<=256) return 8+(int)((s-129)>>5);
+    return 12+(int)((s-257)>>6);
+}
+size_t slab_size(int cls)
+{
+    if(cls<8) return (size_t)(cls+1)<<4;
+    if(cls<12) return 128+((size_t)(cls-7)<<5);
+    return 256+((size_t)(cls-11)<<6);
+}
+size_t slab_slots(int cls)
+{
+    return (run_size-w-align(sizeof(struct run)))/slab_size(cls);
+}
+Run to_run(uint32_t offset)
+{
+    return (Run)to_node(offset);
+}
+size_t page_of(void* ptr)
+{
+    return diff_long(ptr, ctrl)/run_size;
+}
+/* Any pointer can be classified with one bit test, since runs occupy whole pages */
+bool is_slab(void* ptr)
+{
+    size_t page=page_of(ptr);
+    //Threads classify pointers without the lock, mapped_pages is published after the map that covers it
+    if(page>=__atomic_load_n(&ctrl->mapped_pages, __ATOMIC_ACQUIRE)) return false;
+    uint64_t* map=__atomic_load_n(&ctrl->pagemap, __ATOMIC_RELAXED);
+    return (__atomic_load_n(&map[page>>6], __ATOMIC_RELAXED)>>(page&63)) & 1;
+}
+/* The page map is an ordinary allocated block that is replaced by one twice as big when a run lies beyond it */
+bool map_page(size_t page, int bit)
+{
+    if(page>=ctrl->mapped_pages){
+        size_t pages=ctrl->mapped_pages?2*ctrl->mapped_pages:512;
+        while(pages<=page) pages*=2;
+        uint64_t* map=finder(prologue(), align(pages/8+w));
+        if(map==NULL) return false;
+        for(size_t i=0;i<pages/64;i++){
+            map[i]=i<ctrl->mapped_pages/64?ctrl->pagemap[i]:0;
+        }
+        //Another thread may still be reading the old map, so with MM_THREADS it is kept
+#ifndef MM_THREADS
+        if(ctrl->pagemap!=NULL) free_hf(n2h(ctrl->pagemap));
+#endif
+        __atomic_store_n(&ctrl->pagemap, map, __ATOMIC_RELAXED);
+        __atomic_store_n(&ctrl->mapped_pages, pages, __ATOMIC_RELEASE);
+    }
+    uint64_t val=ctrl->pagemap[page>>6];
+    if(bit) val|=(uint64_t)1<<(page&63);
+    else val&=~((uint64_t)1<<(page&63));
+    __atomic_store_n(&ctrl->pagemap[page>>6], val, __ATOMIC_RELAXED);
+    return true;
+}
+/* runs[cls] is a circular doubly linked list of compressed offsets like the free lists */
+void add_run(Run run)
+{
+    uint32_t offset=to_offset((Node)run);
+    uint32_t first=ctrl->runs[run->cls];
+    if(first==0){
+        run->prev=run->next=offset;
     }
-    //If get_freeblock is successful, a free node of the required size cannot be found and the heap must be extended
     else{
-        dbg_printf("null\n");
-        void* payload_ptr=extend(block_size);
-        return payload_ptr;
+        run->prev=to_run(first)->prev;
+        run->next=first;
+        to_run(run->prev)->next=offset;
+        to_run(first)->prev=offset;
     }
-    return NULL;
+    ctrl->runs[run->cls]=offset;
 }
-void* malloc(size_t size)
+void remove_run(Run run)
+{
+    uint32_t offset=to_offset((Node)run);
+    if(run->next==offset){
+        ctrl->runs[run->cls]=0;
+        return;
+    }
+    if(ctrl->runs[run->cls]==offset) ctrl->runs[run->cls]=run->next;
+    to_run(run->prev)->next=run->next;
+    to_run(run->next)->prev=run->prev;
+}
+Run make_run(int cls)
+{
+    //Runs are exactly run_size long, so runs placed one after another all stay aligned
+    void* ptr=place_aligned(run_size, run_size);
+    if(ptr==NULL) return NULL;
+    Run run=h2n(ptr);
+    if(!map_page(page_of(run), 1)){
+        free_hf(ptr);
+        return NULL;
+    }
+    run->cls=cls;
+    run->used=0;
+    run->free=0;
+    run->bump=1;
+#ifdef MM_HARDEN
+    memset(run->live, 0, sizeof(run->live));
+#endif
+    add_run(run);
+    return run;
+}
+void* slot_of(Run run, size_t slot)
+{
+    return incr(run, align(sizeof(struct run))+(slot-1)*slab_size(run->cls));
+}
+#ifdef MM_HARDEN
+/* 2^24 divided by the slot size of each class in units of 16 bytes, plus 1. Read only, so not one of the globals. */
+static const uint32_t slot_inverse[slab_classes]={
+    (1<<24)/1+1, (1<<24)/2+1, (1<<24)/3+1, (1<<24)/4+1, (1<<24)/5+1, (1<<24)/6+1, (1<<24)/7+1, (1<<24)/8+1,
+    (1<<24)/10+1, (1<<24)/12+1, (1<<24)/14+1, (1<<24)/16+1, (1<<24)/20+1, (1<<24)/24+1, (1<<24)/28+1, (1<<24)/32+1
+};
+/* The number of the slot that starts at ptr, or 0. Below run_size the product of the offset and the inverse of the slot 
+size holds the quotient above bit 24, and its low 24 bits stay below the inverse only when there is no remainder. */
+size_t slot_number(Run run, void* ptr)
+{
+    size_t inverse=slot_inverse[run->cls];
+    dbg_assert(inverse==((size_t)1<<24)/(slab_size(run->cls)>>4)+1);
+    size_t offset=diff_long(ptr, slot_of(run, 1));
+    if(offset>=run_size || offset%16!=0) return 0;
+    size_t product=(offset>>4)*inverse;
+    size_t slot=(product>>24)+1;
+    return (product & (((size_t)1<<24)-1))<inverse && slot<run->bump?slot:0;
+}
+#endif
+/* Slots have no header, so with MM_HARDEN their run keeps a bit per slot that claim_slot() sets when the slot is handed 
+out and check_slot() clears when it is freed. A slot freed twice finds its bit clear, a pointer that is not a slot of its 
+run is rejected. The bits live in the run header, which free() reads anyway, and not in the slot, whose line is often cold 
+by the time it is freed. Thread caches hand out and take back slots without the lock, so there the bits are flipped atomically. */
+void check_slot(void* ptr)
+{
+#ifdef MM_HARDEN
+    Run run=(Run)((size_t)ptr & ~(size_t)(run_size-1));
+    size_t slot=slot_number(run, ptr);
+    if(slot==0) corrupt("invalid pointer", ptr);
+    uint64_t bit=(uint64_t)1<<(slot&63);
+#ifdef MM_THREADS
+    uint64_t live=__atomic_fetch_and(&run->live[slot>>6], ~bit, __ATOMIC_RELAXED);
+#else
+    uint64_t live=run->live[slot>>6];
+    run->live[slot>>6]=live & ~bit;
+#endif
+    if(!(live & bit)) corrupt("double free", ptr);
+#endif
+}
+/* The slot number is 0 when the caller does not know it */
+void* claim_slot(Run run, size_t slot, void* ptr)
+{
+#ifdef MM_HARDEN
+    if(slot==0) slot=slot_number(run, ptr);
+#ifdef MM_THREADS
+    __atomic_fetch_or(&run->live[slot>>6], (uint64_t)1<<(slot&63), __ATOMIC_RELAXED);
+#else
+    run->live[slot>>6]|=(uint64_t)1<<(slot&63);
+#endif
+#endif
+    return ptr;
+}
+/* Allocating from a run pops its free list or bumps into the never used slots, no header is written.
+When a class has no run with free slots, a fitting free block of the heap is used before a new run is made */
+void* slab_alloc(size_t size)
+{
+    int cls=slab_class(size);
+    Run run=to_run(ctrl->runs[cls]);
+    if(run==NULL){
+        //Free blocks left over in the heap, like the slack of aligning a run, are used up before a new run is made
+        size_t block_size=align(size+w);
+        void* freeblock=get_freeblock(block_size<min_block?min_block:block_size);
+        if(freeblock!=NULL) return allocate(n2h(freeblock), block_size<min_block?min_block:block_size);
+        run=make_run(cls);
+    }
+    if(run==NULL) return NULL;
+
+    void* slot;
+    size_t number;
+    if(run->free!=0){
+        number=run->free;
+        slot=slot_of(run, number);
+        run->free=*(uint16_t*)slot;
+#ifdef MM_HARDEN
+        if(run->free>=run->bump) corrupt("corrupted slab run", slot);
+#endif
+    }
+    else{
+        number=run->bump++;
+        slot=slot_of(run, number);
+    }
+    run->used++;
+    //Full runs leave the list until one of their slots is freed
+    if(run->used==slab_slots(cls)) remove_run(run);
+    dbg_assert(aligned(slot));
+    return claim_slot(run, number, slot);
+}
+/* An empty run is given back to the heap unless it is the only run of its class with free slots */
+void slab_free(void* ptr)
+{
+    Run run=(Run)((size_t)ptr & ~(size_t)(run_size-1));
+    size_t slots=slab_slots(run->cls);
+    dbg_assert(run->used>0);
+    if(run->used==slots) add_run(run);
+    *(uint16_t*)ptr=run->free;
+    run->free=(uint16_t)(diff_long(ptr, slot_of(run, 1))/slab_size(run->cls)+1);
+    run->used--;
+    if(run->used==0 && run->next!=to_offset((Node)run)){
+        remove_run(run);
+        map_page(page_of(run), 0);
+        free_hf(n2h(run));
+    }
+}
+
+#ifdef MM_THREADS
+/* The calling thread's cache, made on first use. NULL is returned if the heap has no room for it */
+Cache get_cache()
+{
+    if(cache!=NULL && cache_gen==generation) return cache;
+    heap_lock();
+    void* payload_ptr=finder(prologue(), align(sizeof(struct cache)+w));
+    heap_unlock();
+    if(payload_ptr==NULL) return NULL;
+    Cache c=payload_ptr;
+    for(int cls=0;cls<slab_classes;cls++){
+        c->slot[cls]=NULL;
+        c->count[cls]=0;
+    }
+    cache=c;
+    cache_gen=generation;
+    pthread_setspecific(cache_key, c);
+    return c;
+}
+/* Slots beyond keep are handed back to their runs, the caller holds the lock */
+void drain_cache(Cache c, int cls, uint32_t keep)
+{
+    while(c->count[cls]>keep){
+        void* slot=c->slot[cls];
+        c->slot[cls]=*(void**)slot;
+        c->count[cls]--;
+        if(is_slab(slot)) slab_free(slot);
+        else free_hf(n2h(slot));
+    }
+}
+/* A miss refills cache_batch slots under a single acquisition of the lock */
+void* cache_alloc(Cache c, size_t size)
+{
+    int cls=slab_class(size);
+    if(c->slot[cls]==NULL){
+        heap_lock();
+        for(int i=0;i<cache_batch;i++){
+            void* slot=slab_alloc(slab_size(cls));
+            if(slot==NULL) break;
+            *(void**)slot=c->slot[cls];
+            c->slot[cls]=slot;
+            c->count[cls]++;
+        }
+        heap_unlock();
+        if(c->slot[cls]==NULL) return NULL;
+    }
+    void* slot=c->slot[cls];
+    c->slot[cls]=*(void**)slot;
+    c->count[cls]--;
+    //A class without runs may have cached blocks of the heap
+    if(!is_slab(slot)) return slot;
+    return claim_slot((Run)((size_t)slot & ~(size_t)(run_size-1)), 0, slot);
+}
+/* Runs are shared, so a slot freed by another thread than the one that allocated it simply joins the freeing thread's cache */
+void cache_free(Cache c, void* ptr, int cls)
+{
+    *(void**)ptr=c->slot[cls];
+    c->slot[cls]=ptr;
+    c->count[cls]++;
+    if(c->count[cls]>cache_max){
+        heap_lock();
+        drain_cache(c, cls, cache_max/2);
+        heap_unlock();
+    }
+}
+/* Runs when a thread exits and gives its whole cache back */
+void release_cache(void* ptr)
+{
+    Cache c=ptr;
+    if(c!=cache || cache_gen!=generation) return;
+    heap_lock();
+    for(int cls=0;cls<slab_classes;cls++){
+        drain_cache(c, cls, 0);
+    }
+    free_hf(n2h(c));
+    heap_unlock();
+    cache=NULL;
+}
+#endif
+
+/* Serves a request from the blocks of the heap, the caller holds the lock */
+void* block_alloc(size_t size)
 {
-    //Obtain the start of the heap
-    void* ptr=mm_heap_lo();
     //Pad and align the payload size  to ensure the return of aligned addresses 
-    ptr=incr(ptr, 8); 
     size=align(size+w);
-    if(size<32) size=32;//Minimum size of a freenode can be 32 bytes
+    if(size<min_block) size=min_block;//Minimum size of a freenode is min_block bytes
+    void* payload_ptr=size<=quick_limit?quick_pop(size):NULL;
+    if(payload_ptr==NULL) payload_ptr=finder(prologue(), size);
+    return payload_ptr;
+}
 
+void* malloc(size_t size)
+{
+    startup();
+    count(stat_malloc, 1);
+    //Small requests are served by the slab tier
+    if(size<=slab_limit){
+#ifdef MM_THREADS
+        Cache c=get_cache();
+        if(c!=NULL) return cache_alloc(c, size);
+#endif
+        heap_lock();
+        mm_checkheap(__LINE__);
+        void* slot=slab_alloc(size);
+        mm_checkheap(__LINE__);
+        heap_unlock();
+        return slot;
+    }
+    //Huge requests are served from the heap only when no region can be mapped, no block is bigger than the heap can be
+    if(size>=map_threshold){
+        if(size>max_heap){
+            errno=ENOMEM;
+            return NULL;
+        }
+        heap_lock();
+        void* payload_ptr=map_alloc(size);
+        heap_unlock();
+        if(payload_ptr!=NULL) return payload_ptr;
+    }
     dbg_printf("\n\nMalloc starts for size:%zu\n", size);
     //Run the heap consistency checker
+    heap_lock();
     mm_checkheap(__LINE__);
     dbg_printf("Before malloc:\n");    
     printheap(__LINE__);
-    void* payload_ptr=finder(ptr, size);
+    void* payload_ptr=block_alloc(size);
     dbg_printf("After malloc:\n");
     printheap(__LINE__);
     dbg_printf("Returned at end of malloc: %p\n",payload_ptr);
     mm_checkheap(__LINE__);
+    heap_unlock();
 
     return payload_ptr;
 }
@@ -539,20 +1486,134 @@ void* malloc(size_t size)
 void free(void* ptr)
 {
     if (ptr!=NULL){
+        count(stat_free, 1);
         dbg_printf("\n\nTo free:%p\n", ptr);
+        if(is_mapped(ptr)){
+            check_block(ptr);
+            heap_lock();
+            map_free(ptr);
+            heap_unlock();
+            return;
+        }
+#ifdef MM_THREADS
+        if(is_slab(ptr)){
+            Cache c=get_cache();
+            if(c!=NULL){
+                check_slot(ptr);
+                cache_free(c, ptr, ((Run)((size_t)ptr & ~(size_t)(run_size-1)))->cls);
+                return;
+            }
+        }
+#endif
+        heap_lock();
         mm_checkheap(__LINE__);
         printheap(__LINE__);
         dbg_assert(in_heap(ptr));
-        free_hf(n2h(ptr));
+        if(is_slab(ptr)){
+            check_slot(ptr);
+            slab_free(ptr);
+        }
+        else{
+            check_block(ptr);
+            if(get_size(n2h(ptr))<=quick_limit){
+                defer(n2h(ptr));
+                if(ctrl->deferred>quick_max) flush();
+            }
+            else free_hf(n2h(ptr));
+        }
+        trim();
         
         dbg_printf("After free:\n");
         printheap(__LINE__);
         mm_checkheap(__LINE__);        
+        heap_unlock();
     }
 
     return;
 }
 
+#ifdef DEBUG
+/* A size hint must be the size the block was last requested with, so it has to fit the block and lead to its tier */
+bool hint_fits(void* ptr, size_t size)
+{
+    if(is_mapped(ptr)) return size>=map_threshold && size<=map_size(ptr)-ALIGNMENT-w;
+    if(is_slab(ptr)) return size<=slab_limit && slab_class(size)==((Run)((size_t)ptr & ~(size_t)(run_size-1)))->cls;
+    return align(size+w)<=get_size(n2h(ptr));
+}
+#endif
+/* Only requests of up to slab_limit bytes get slots, and realloc() keeps a slot only within its class, so the size tells 
+the class of a slot without reading its run. Heap blocks still read their header, they can be bigger than the size 
+asked for and the quick bins hold exact sizes. */
+void free_sized(void* ptr, size_t size)
+{
+    if(ptr==NULL) return;
+    if(size>slab_limit || !is_slab(ptr)){
+        dbg_assert(hint_fits(ptr, size));
+        free(ptr);
+        return;
+    }
+    count(stat_free, 1);
+#ifdef MM_THREADS
+    Cache c=get_cache();
+    if(c!=NULL){
+        dbg_assert(hint_fits(ptr, size));
+        check_slot(ptr);
+        cache_free(c, ptr, slab_class(size));
+        return;
+    }
+#endif
+    heap_lock();
+    mm_checkheap(__LINE__);
+    dbg_assert(hint_fits(ptr, size));
+    check_slot(ptr);
+    slab_free(ptr);
+    trim();
+    mm_checkheap(__LINE__);
+    heap_unlock();
+}
+
+/* The block being resized is grown in place when the following block is free or is the epilogue, 
+otherwise the payload is copied to a new block and the old block is freed */
+void* resize(void* ptr, size_t block_size)
+{
+    size_t curr_size=get_size(ptr);
+    int prev_alloc=get_prev_alloc(ptr);
+    void* next_header=incr(ptr, curr_size);
+    size_t next_size=get_size(next_header);
+
+    if(block_size<=curr_size){
+        shrink(ptr, block_size);
+        return h2n(ptr);
+    }
+
+    //The free block that follows is absorbed and allocate() splits off whatever is left over
+    size_t total_size=curr_size;
+    if(!is_alloc(next_header)){
+        total_size+=next_size;
+        if(total_size>=block_size){
+            removenode(h2n(next_header), get_index(next_size));
+            make_h(ptr, total_size, get_prev_mini(ptr), prev_alloc, 0);
+            return allocate(ptr, block_size);
+        }
+        next_header=incr(next_header, next_size);
+        next_size=get_size(next_header);
+    }
+
+    //Blocks that end at the epilogue only need the missing bytes from the heap
+    if(next_size==0){
+        if(!grow_heap(block_size-total_size)) return NULL;
+        if(total_size!=curr_size){
+            removenode(h2n(incr(ptr, curr_size)), get_index(total_size-curr_size));
+        }
+        make_h(ptr, block_size, get_prev_mini(ptr), prev_alloc, 1);
+        make_epi(incr(ptr, block_size));
+        link_next(ptr);
+        touch(ptr);
+        return h2n(ptr);
+    }
+    return NULL;
+}
+
 void* realloc(void* oldptr, size_t size)
 {
     if(oldptr==NULL){
@@ -562,73 +1623,494 @@ void* realloc(void* oldptr, size_t size)
     else if(size==0){
         free(oldptr);
     }
+    else if(size>max_heap){
+        //Refused before align() can wrap, the old block is left alone
+        errno=ENOMEM;
+    }
     else{
+        size_t block_size=align(size+w);
+        if(block_size<min_block) block_size=min_block;
+        dbg_printf("\n\nRealloc starts: %p, %zu\n", oldptr, block_size);
+        size_t oldsize;
+        //Mapped blocks are remapped while they stay above the threshold
+        if(is_mapped(oldptr)){
+            check_block(oldptr);
+            if(size>=map_threshold){
+                heap_lock();
+                void* newptr=map_resize(oldptr, size);
+                heap_unlock();
+                return newptr;
+            }
+            oldsize=map_size(oldptr)-ALIGNMENT-w;
+        }
+        //Slots are only reused when the new size maps to the same class, blocks never move into slots in place
+        else if(is_slab(oldptr)){
+            Run run=(Run)((size_t)oldptr & ~(size_t)(run_size-1));
+            //A slot that stays has to pass the check free() would make
+            if(size<=slab_limit && slab_class(size)==run->cls){
+                check_slot(oldptr);
+                return claim_slot(run, 0, oldptr);
+            }
+            oldsize=slab_size(run->cls);
+        }
+        else{
+            heap_lock();
+            mm_checkheap(__LINE__);
+            check_block(oldptr);
+            void* newptr=size<=slab_limit?NULL:resize(n2h(oldptr), block_size);
+            trim();
+            oldsize=get_size(n2h(oldptr))-w;
+            mm_checkheap(__LINE__);
+            heap_unlock();
+            if(newptr!=NULL) return newptr;
+        }
+        //The block could not be resized in place, so its payload is moved
         void* newptr=malloc(size);
-        size_t oldsize=get_size(decr(oldptr,w));
+        if(newptr==NULL) return NULL;
         size_t minsize=size>oldsize?oldsize:size;
         memcpy(newptr, oldptr, minsize);
+        free(oldptr);
         return newptr;
     }
 
     return NULL;
 }
 
+/* Mapped regions and the memory extend() takes from above mm_heap_clean() read as zero, so only the part of a block 
+below the mark as it was before the request is cleared. A big block made by extending the heap costs page faults and no 
+writes: extend() writes the header of the block before its payload and the epilogue and the split remainder after it. */
 void* calloc(size_t nmemb, size_t size)
 {
     void* ptr;
-    size *= nmemb;
-    ptr = malloc(size);
-    if (ptr) {
-        memset(ptr, 0, size);
+    //A product above max_heap would still wrap in align() and in the bounds of the heap
+    if(__builtin_mul_overflow(nmemb, size, &size) || size>max_heap){
+        errno=ENOMEM;
+        return NULL;
+    }
+    if(size<=slab_limit){
+        ptr=malloc(size);
+        if(ptr!=NULL) memset(ptr, 0, size);
+        return ptr;
     }
+    startup();
+    count(stat_malloc, 1);
+    heap_lock();
+    ptr=size>=map_threshold?map_alloc(size):NULL;
+    if(ptr!=NULL){
+        heap_unlock();
+        return ptr;
+    }
+    mm_checkheap(__LINE__);
+    char* clean=mm_heap_clean();
+    ptr=block_alloc(size);
+    mm_checkheap(__LINE__);
+    heap_unlock();
+    if(ptr==NULL) return NULL;
+    size_t dirty=(char*)ptr<clean?(size_t)(clean-(char*)ptr):0;
+    memset(ptr, 0, dirty<size?dirty:size);
     return ptr;
 }
 
-void freechecker()
+/* Every block meets alignments of up to ALIGNMENT. Bigger ones are placed in the heap by place_aligned(), which gives the 
+slack on either side back to the free lists, since slots and mapped regions are only ALIGNMENT aligned. */
+void* memalign(size_t alignment, size_t size)
+{
+    if(alignment==0 || (alignment&(alignment-1))!=0) return NULL;
+    if(alignment<=ALIGNMENT) return malloc(size);
+    if(size>max_heap || alignment>max_heap) return NULL;
+    startup();
+    count(stat_malloc, 1);
+    size_t block_size=align(size+w);
+    if(block_size<min_block) block_size=min_block;
+
+    heap_lock();
+    mm_checkheap(__LINE__);
+    void* ptr=place_aligned(block_size, alignment);
+    mm_checkheap(__LINE__);
+    heap_unlock();
+    return ptr==NULL?NULL:h2n(ptr);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    if(alignment==0 || alignment%sizeof(void*)!=0 || (alignment&(alignment-1))!=0) return EINVAL;
+    void* ptr=memalign(alignment, size);
+    if(ptr==NULL) return ENOMEM;
+    *memptr=ptr;
+    return 0;
+}
+
+/* Cuts up to n allocated blocks of block_size bytes out of the free block whose node is freeblock, in address order, 
+with a single pass over their headers. A tail of at least min_block bytes is put back in the lists, a smaller one goes to 
+the last block. Returns the number of blocks cut, their payloads are stored in out */
+size_t carve(void* freeblock, size_t block_size, size_t n, void** out)
+{
+    void* ptr=n2h(freeblock);
+    size_t total_size=get_size(ptr);
+    size_t blocks=total_size/block_size<n?total_size/block_size:n;
+    size_t rest=total_size-blocks*block_size;
+    int prev_mini=get_prev_mini(ptr);
+    int prev_alloc=get_prev_alloc(ptr);
+    void* last=ptr;
+
+    for(size_t i=0;i<blocks;i++){
+        size_t size=(i==blocks-1 && rest<min_block)?block_size+rest:block_size;
+        make_h(ptr, size, prev_mini, prev_alloc, 1);
+        out[i]=incr(ptr, w);
+        prev_mini=size==min_block;
+        prev_alloc=1;
+        last=ptr;
+        ptr=incr(ptr, size);
+    }
+    if(rest>=min_block){
+        make_h(ptr, rest, prev_mini, 1, 0);
+        if(rest>min_block) make_f(get_f(ptr), rest, 0);
+        link_next(ptr);
+        addnode(h2n(ptr));
+        count(stat_split, 1);
+    }
+    else link_next(last);
+    touch(last);
+    return blocks;
+}
+
+/* Allocates n blocks of size bytes and stores them in out, returning how many were allocated, which is less than n only 
+when memory runs out. Heap blocks are carved from a single free block or a single extension of the heap big enough for 
+all of them, after the quick bin of their size is used up. When no free block is big enough, each free block that fits 
+some of them is carved in turn first. Slots and mapped regions are taken one at a time. */
+size_t malloc_batch(size_t size, size_t n, void** out)
+{
+    size_t done=0;
+    if(size>=map_threshold){
+        for(;done<n && (out[done]=malloc(size))!=NULL;done++);
+        return done;
+    }
+    startup();
+    heap_lock();
+    mm_checkheap(__LINE__);
+    if(size<=slab_limit){
+        for(;done<n && (out[done]=slab_alloc(size))!=NULL;done++);
+    }
+    else{
+        size_t block_size=align(size+w);
+        void* payload_ptr;
+        if(block_size<=quick_limit){
+            for(;done<n && (payload_ptr=quick_pop(block_size))!=NULL;done++) out[done]=payload_ptr;
+        }
+        while(done<n){
+            //The request for one block of n-done blocks is capped by max_heap, carve() takes what fits
+            size_t want=n-done<max_heap/block_size?(n-done)*block_size:max_heap;
+            void* freeblock=get_freeblock(want);
+            //Without a free block for all of them the smaller free blocks are carved before the heap grows
+            if(freeblock==NULL) freeblock=get_freeblock(block_size);
+            if(freeblock==NULL) freeblock=extend(want);
+            if(freeblock==NULL) break;
+            done+=carve(freeblock, block_size, n-done, out+done);
+        }
+        //Without room for one block the rest are found one at a time
+        for(;done<n && (payload_ptr=finder(prologue(), block_size))!=NULL;done++) out[done]=payload_ptr;
+    }
+    count(stat_malloc, done);
+    mm_checkheap(__LINE__);
+    heap_unlock();
+    return done;
+}
+
+int compare_ptr(const void* a, const void* b)
+{
+    char* x=*(char* const*)a;
+    char* y=*(char* const*)b;
+    return (x>y)-(x<y);
+}
+
+/* Frees the n blocks of ptrs, which is sorted by address in place. Blocks of the heap that follow each other are joined 
+into one block and coalesced with its neighbours once, freed blocks are never deferred in the quick bins. */
+void free_batch(void** ptrs, size_t n)
+{
+    startup();
+    qsort(ptrs, n, sizeof(void*), compare_ptr);
+    heap_lock();
+    mm_checkheap(__LINE__);
+    for(size_t i=0;i<n;i++){
+        void* ptr=ptrs[i];
+        if(ptr==NULL) continue;
+        count(stat_free, 1);
+        if(is_mapped(ptr)){
+            check_block(ptr);
+            map_free(ptr);
+        }
+        else if(is_slab(ptr)){
+            check_slot(ptr);
+            slab_free(ptr);
+        }
+        else{
+            void* header=n2h(ptr);
+            size_t size=get_size(header);
+            dbg_assert(in_heap(ptr) && is_alloc(header) && !is_deferred(header));
+            check_block(ptr);
+            //The payload of the next block lies size bytes after this one
+            while(i+1<n && ptrs[i+1]==incr(ptr, size)){
+                count(stat_free, 1);
+                check_block(ptrs[++i]);
+                retire(n2h(ptrs[i]));
+                size+=get_size(n2h(ptrs[i]));
+            }
+            make_h(header, size, get_prev_mini(header), get_prev_alloc(header), 1);
+            free_hf(header);
+        }
+    }
+    trim();
+    mm_checkheap(__LINE__);
+    heap_unlock();
+}
+
+/* Arenas are made of ordinary blocks, so they take the heap lock only when a chunk is allocated or freed. 
+An arena must not be used by two threads at once. */
+Arena arena_create()
+{
+    Arena a=malloc(sizeof(struct mm_arena));
+    if(a==NULL) return NULL;
+    *a=(struct mm_arena){0};
+    a->next_size=arena_chunk;
+    return a;
+}
+Chunk new_chunk(Arena a, size_t size)
+{
+    Chunk c=malloc(size);
+    if(c==NULL) return NULL;
+    c->size=size;
+    c->next=a->chunks;
+    a->chunks=c;
+    return c;
+}
+void* arena_alloc(Arena a, size_t size)
+{
+    if(size>max_heap) return NULL;
+    size=size==0?ALIGNMENT:align(size);
+    if(size<=(size_t)(a->end-a->bump)){
+        void* ptr=a->bump;
+        a->bump+=size;
+        return ptr;
+    }
+    //A chunk of a big object may be a mapped region, so offsets into chunks do without incr() and its heap check
+    size_t header=align(sizeof(struct chunk));
+    if(size>a->next_size/4){
+        Chunk c=new_chunk(a, header+size);
+        return c==NULL?NULL:(char*)c+header;
+    }
+    Chunk c=new_chunk(a, a->next_size);
+    if(c==NULL) return NULL;
+    a->current=c;
+    a->bump=(char*)c+header+size;
+    a->end=(char*)c+a->next_size;
+    if(a->next_size<arena_max) a->next_size*=2;
+    return (char*)c+header;
+}
+/* Frees every chunk but the current one, the biggest of the bumped chunks, which is bumped from its start again */
+void arena_reset(Arena a)
+{
+    for(Chunk c=a->chunks, next;c!=NULL;c=next){
+        next=c->next;
+        if(c!=a->current) free(c);
+    }
+    a->chunks=a->current;
+    if(a->current!=NULL){
+        a->current->next=NULL;
+        a->bump=(char*)a->current+align(sizeof(struct chunk));
+    }
+}
+void arena_destroy(Arena a)
+{
+    arena_reset(a);
+    free(a->current);
+    free(a);
+}
+
+#ifdef MM_STATS
+/* Adds the blocks of the tree to the totals of its class */
+void tree_stats(Tree t, struct mm_stats* stats)
+{
+    if(t==NULL) return;
+    stats->bin_bytes[treeindex]+=get_size(n2h(t));
+    stats->bin_blocks[treeindex]++;
+    tree_stats(t->left, stats);
+    tree_stats(t->right, stats);
+}
+#endif
+
+/* Fills in stats from the event counters and from a walk of the heap and of the lists */
+bool mm_stats(struct mm_stats* stats)
+{
+#ifdef MM_STATS
+    _Static_assert(MM_STATS_BINS==maxindex, "one bin per list");
+    startup();
+    heap_lock();
+    *stats=(struct mm_stats){0};
+    stats->heap_bytes=mm_heapsize();
+    for(void* ptr=prologue();get_size(ptr)!=0;ptr=incr(ptr, get_size(ptr))){
+        size_t size=get_size(ptr);
+        if(is_deferred(ptr)) stats->deferred_bytes+=size;
+        else if(is_alloc(ptr)){
+            stats->used_bytes+=size;
+            stats->used_blocks++;
+            if(is_slab(h2n(ptr))) stats->slab_bytes+=size;
+        }
+        else{
+            stats->free_bytes+=size;
+            stats->free_blocks++;
+            if(size>stats->largest_free) stats->largest_free=size;
+        }
+    }
+    for(int index=0;index<treeindex;index++){
+        Node x=ctrl->head[index];
+        if(x==NULL) continue;
+        do{
+            stats->bin_bytes[index]+=get_size(n2h(x));
+            stats->bin_blocks[index]++;
+            x=next_node(x);
+        }while(x!=ctrl->head[index]);
+    }
+    tree_stats(ctrl->root, stats);
+    stats->mallocs=events[stat_malloc];
+    stats->frees=events[stat_free];
+    stats->extends=events[stat_extend];
+    stats->splits=events[stat_split];
+    stats->coalesces=events[stat_coalesce];
+    stats->searches=events[stat_search];
+    stats->scanned=events[stat_scan];
+    stats->maps=events[stat_map];
+    heap_unlock();
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* Walks the blocks the way printheap() does and records the first n of them */
+size_t mm_heap_map(struct mm_block* map, size_t n)
 {
+#ifdef MM_STATS
+    size_t count=0;
+    startup();
+    heap_lock();
+    for(void* ptr=prologue();get_size(ptr)!=0;ptr=incr(ptr, get_size(ptr))){
+        if(count<n){
+            map[count].offset=diff_long(ptr, mm_heap_lo());
+            map[count].size=get_size(ptr);
+            if(is_deferred(ptr)) map[count].state='d';
+            else if(!is_alloc(ptr)) map[count].state='f';
+            else map[count].state=is_slab(h2n(ptr))?'s':'a';
+        }
+        count++;
+    }
+    heap_unlock();
+    return count;
+#else
+    return 0;
+#endif
+}
+
 #ifdef DEBUG
-    int useful_heads=0;
-    for (int index=0;index<maxindex;index++){
-        if(head[index]!=NULL){
-            Node x=head[index];
+/* Counts the nodes of the tree, checking that each is a free block of the tree's size range */
+size_t count_tree(Tree t)
+{
+    if(t==NULL) return 0;
+    dbg_assert(in_heap(t) && !is_alloc(n2h(t)));
+    dbg_assert(get_index(get_size(n2h(t)))==treeindex);
+    return 1+count_tree(t->left)+count_tree(t->right);
+}
+/* 1) Counts the listed free blocks, checking that each list is linked both ways and holds only free blocks of its class. 
+Comparing the count with the number of free blocks in the heap replaces a search of the list for every block. */
+size_t count_free()
+{
+    size_t listed=0;
+    for (int index=0;index<treeindex;index++){
+        dbg_assert((ctrl->head[index]!=NULL)==((ctrl->bitmap>>index)&1));
+        if(ctrl->head[index]!=NULL){
+            Node x=ctrl->head[index];
             do{
                 void* header=n2h(x);
                 dbg_assert(in_heap(x));
-                dbg_assert(!is_alloc(header));
-                x=x->next;
-                
-            }while(x!=head[index]);
-            useful_heads++;
-        }  
+                dbg_assert(!is_alloc(header) && get_index(get_size(header))==index);
+                dbg_assert(prev_node(next_node(x))==x);
+                dbg_assert(!is_sorted(index) || next_node(x)==ctrl->head[index] || get_size(header)<=get_size(n2h(next_node(x))));
+                listed++;
+                x=next_node(x);
+            }while(x!=ctrl->head[index]);
+        }
+    }
+    dbg_assert((ctrl->root!=NULL)==((ctrl->bitmap>>treeindex)&1));
+    return listed+count_tree(ctrl->root);
+}
+/* Checks the block at ptr against its neighbours, the same invariants as the full walk but without reaching them 
+from the prologue. The previous block is found through its footer when it is free. */
+void check_local(void* ptr)
+{
+    void* epilogue=decr(mm_heap_hi(), w-1);
+    //The block may since have been given back by trim()
+    if(ptr==NULL || (char*)ptr>=(char*)epilogue) return;
+    size_t block_size=get_size(ptr);
+    dbg_assert(block_size>=min_block && aligned(incr(ptr, w)));
+    void* next_header=incr(ptr, block_size);
+    dbg_assert(get_prev_alloc(next_header)==is_alloc(ptr));
+    dbg_assert(get_prev_mini(next_header)==(block_size==min_block));
+    if(!is_alloc(ptr)){
+        dbg_assert(block_size==min_block || block_size==get_size(get_f(ptr)));
+        dbg_assert(get_prev_alloc(ptr) && is_alloc(next_header));
+        if(get_index(block_size)!=treeindex){
+            Node x=h2n(ptr);
+            dbg_assert(prev_node(next_node(x))==x && next_node(prev_node(x))==x);
+        }
+    }
+    if(!get_prev_alloc(ptr)){
+        size_t prev_size=get_prev_mini(ptr)?min_block:get_size(decr(ptr, w));
+        void* prev_header=decr(ptr, prev_size);
+        dbg_assert(!is_alloc(prev_header) && get_size(prev_header)==prev_size);
+        dbg_assert(get_prev_alloc(prev_header));
     }
-    // dbg_printf("\n\n Non-empty lists:%d\n", useful_heads);
-#endif
-    return;
 }
+#endif
 
 bool mm_checkheap(int line_number)
 {
 #ifdef DEBUG
+    check_calls++;
+    if(check_every==0 || check_calls%check_every!=0){
+        check_local(last_block);
+        return true;
+    }
     
-    void* ptr=mm_heap_lo();
-    ptr=incr(ptr, w); 
+    void* ptr=prologue();
     size_t block_size=get_size(ptr);
     int prev=0;
     int curr;
+    size_t prev_size=0;
+    size_t deferred=0;
+    size_t free_blocks=0;
     // int block_num=0;
 
-    //Check to see if all free nodes are actually free
-    // freechecker();
-
     while(block_size!=0)
     {
         //2) Check to see if all header ptrs are in heap
         dbg_assert(in_heap(ptr));
 
-        if (!is_alloc(ptr) ){ //checks free blocks to verify if header size=footer size
-            dbg_assert(block_size==get_size(get_f(ptr)));
+        //7) Check that runs are whole aligned blocks with sane slot counts
+        if (is_alloc(ptr) && is_slab(h2n(ptr))){
+            Run run=h2n(ptr);
+            dbg_assert(block_size==run_size && (size_t)run%run_size==0);
+            dbg_assert(run->cls<slab_classes);
+            dbg_assert(run->used<=slab_slots(run->cls) && run->bump<=slab_slots(run->cls)+1);
+        }
+        if (!is_alloc(ptr) ){ //checks free blocks to verify if header size=footer size, minimum blocks have no footer
+            dbg_assert(block_size==min_block || block_size==get_size(get_f(ptr)));
             dbg_assert(aligned(incr(ptr,w)));
             dbg_assert(in_heap(h2n(ptr)));
+            free_blocks++;
         }
 
         //3) Check to see if prev_alloc bit is set correctly
@@ -638,8 +2120,15 @@ bool mm_checkheap(int line_number)
         //dbg_printf("For block %d: %d, %d, %p, %p\n", block_num, prev, curr, ptr, mm_heap_hi());
         dbg_assert(prev==curr);
         prev=is_alloc(ptr);
-        //4) Check that no consecutive blocks are free
+        //4) Check that no consecutive blocks are free, deferred blocks count as allocated until they are flushed
         dbg_assert(!(prev==0 && curr==0)); 
+        if(is_deferred(ptr)){
+            dbg_assert(prev==1 && block_size<=quick_limit);
+            deferred++;
+        }
+        //6) Check that the prev_mini bit is set exactly when the previous block is a minimum block
+        dbg_assert(get_prev_mini(ptr)==(prev_size==min_block));
+        prev_size=block_size;
 
         ptr=incr(ptr,block_size);
         block_size=get_size(ptr);
@@ -647,6 +2136,20 @@ bool mm_checkheap(int line_number)
 //5)Looping by adding block_size to header gives the next block's header. 
 //If blocks overlap, then incr(header, get_size(header)) will point outside the heap throwing an assertion
 
+    //1) Check that the lists and the tree hold exactly the free blocks of the heap
+    dbg_assert(count_free()==free_blocks);
+
+    //8) Check that every deferred block is in the bin of its size and that the bins hold nothing else
+    size_t binned=0;
+    for(size_t index=0;index<(quick_limit>>4);index++){
+        for(Node x=to_node(ctrl->quick[index]);x!=NULL;x=to_node(x->next)){
+            dbg_assert(is_alloc(n2h(x)) && is_deferred(n2h(x)));
+            dbg_assert(get_size(n2h(x))==(index+1)<<4);
+            binned++;
+        }
+    }
+    dbg_assert(binned==deferred && deferred==ctrl->deferred);
+
 #endif // DEBUG
     return true;
 }
@@ -1,25 +1,92 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mm_arena;
+
 #ifdef DRIVER
 
 /* declare functions for driver tests */
 extern void* mm_malloc (size_t size);
 extern void mm_free (void* ptr);
+extern void mm_free_sized(void* ptr, size_t size);
 extern void* mm_realloc(void* ptr, size_t size);
 extern void* mm_calloc (size_t nmemb, size_t size);
+extern void* mm_memalign(size_t alignment, size_t size);
+extern void* mm_aligned_alloc(size_t alignment, size_t size);
+extern int mm_posix_memalign(void** memptr, size_t alignment, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void** out);
+extern void mm_free_batch(void** ptrs, size_t n);
+extern struct mm_arena* mm_arena_create(void);
+extern void* mm_arena_alloc(struct mm_arena* arena, size_t size);
+extern void mm_arena_reset(struct mm_arena* arena);
+extern void mm_arena_destroy(struct mm_arena* arena);
 
 #else
 
 /* declare functions for interpositioning */
 extern void* malloc (size_t size);
 extern void free (void* ptr);
+/* Frees a block given the size it was last requested with, as C++ sized deallocation does */
+extern void free_sized(void* ptr, size_t size);
 extern void* realloc(void* ptr, size_t size);
 extern void* calloc (size_t nmemb, size_t size);
+extern void* memalign(size_t alignment, size_t size);
+extern void* aligned_alloc(size_t alignment, size_t size);
+extern int posix_memalign(void** memptr, size_t alignment, size_t size);
+/* Allocates n blocks of one size into out and returns how many it got */
+extern size_t malloc_batch(size_t size, size_t n, void** out);
+/* Frees n blocks at once, sorting ptrs by address in place */
+extern void free_batch(void** ptrs, size_t n);
+/* An arena hands out objects that are freed all at once by arena_reset() or arena_destroy() */
+extern struct mm_arena* arena_create(void);
+extern void* arena_alloc(struct mm_arena* arena, size_t size);
+extern void arena_reset(struct mm_arena* arena);
+extern void arena_destroy(struct mm_arena* arena);
 
 #endif
 
 extern bool mm_init(void);
 
+/* Allocator statistics, filled in by mm_stats() when mm.c is built with MM_STATS */
+#define MM_STATS_BINS 44
+struct mm_stats {
+    size_t heap_bytes;                  /* bytes between the heap start and the break */
+    size_t used_bytes, used_blocks;     /* allocated blocks, headers and slab runs included */
+    size_t slab_bytes;                  /* runs of the slab tier */
+    size_t deferred_bytes;              /* freed blocks still waiting in the quick bins */
+    size_t free_bytes, free_blocks;     /* free blocks of the heap */
+    size_t largest_free;                /* size of the largest free block */
+    size_t bin_bytes[MM_STATS_BINS];    /* free bytes in each size class, the last is the tree */
+    size_t bin_blocks[MM_STATS_BINS];
+    size_t mallocs, frees;              /* calls so far */
+    size_t extends;                     /* times the heap was grown for a block */
+    size_t splits, coalesces;           /* blocks split by malloc, neighbours merged by free */
+    size_t searches, scanned;           /* free list searches and list nodes they inspected */
+    size_t maps;                        /* huge blocks given a region of their own */
+};
+
+/* Returns false, leaving stats alone, if mm.c was built without MM_STATS */
+extern bool mm_stats(struct mm_stats* stats);
+
+/* One block of the heap, as listed by mm_heap_map() */
+struct mm_block {
+    size_t offset;                      /* of the header from the start of the heap */
+    size_t size;                        /* of the block, header included */
+    char state;                         /* 'a' allocated, 'f' free, 'd' deferred in a quick bin, 's' slab run */
+};
+
+/* Lists the first n blocks of the heap in address order and returns how many there are, 
+   mapped regions are not included. A MM_STATS build places blocks as the release build does.
+   Returns 0 if mm.c was built without MM_STATS */
+extern size_t mm_heap_map(struct mm_block* map, size_t n);
+
 /* This is for debugging.  Returns false if error encountered */
 extern bool mm_checkheap(int line_number);
+
+#ifdef __cplusplus
+}
+#endif
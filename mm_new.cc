@@ -0,0 +1,115 @@
+/*
+ * mm_new.cc
+ *
+ * Replacements for the global operator new and operator delete, linked into libmm.so so C++ programs that preload it
+ * allocate from mm.c without any change. Sized deletes go to free_sized(), which finds the class of a slot from the
+ * size instead of its run. Over-aligned types use memalign() and their deletes ignore the size.
+ */
+
+#include <new>
+#include <cstddef>
+#include "mm.h"
+
+/* A failed request calls the new handler until it succeeds or there is no handler left */
+static void* allocate(std::size_t size, std::size_t alignment)
+{
+    for(;;){
+        void* ptr=alignment<=__STDCPP_DEFAULT_NEW_ALIGNMENT__?malloc(size):memalign(alignment, size);
+        if(ptr!=NULL) return ptr;
+        std::new_handler handler=std::get_new_handler();
+        if(handler==NULL) throw std::bad_alloc();
+        handler();
+    }
+}
+static void* allocate_nothrow(std::size_t size, std::size_t alignment) noexcept
+{
+    try{
+        return allocate(size, alignment);
+    }
+    catch(...){
+        return NULL;
+    }
+}
+
+void* operator new(std::size_t size)
+{
+    return allocate(size, 0);
+}
+void* operator new[](std::size_t size)
+{
+    return allocate(size, 0);
+}
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate_nothrow(size, 0);
+}
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate_nothrow(size, 0);
+}
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+//Arrays are deleted with the size given to operator new[], cookie included
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void* ptr) noexcept
+{
+    free(ptr);
+}
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+    free_sized(ptr, size);
+}
+void operator delete[](void* ptr, std::size_t size) noexcept
+{
+    free_sized(ptr, size);
+}
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(ptr);
+}
@@ -0,0 +1,640 @@
+/*
+ * recorder.c - capture the allocation requests of a program as a trace
+ *
+ * Built as librecord.so (make record) and loaded with
+ *
+ *     MM_RECORD=out.rep LD_PRELOAD=./librecord.so program ...
+ *
+ * malloc, calloc, realloc, free and the aligned allocators are passed on
+ * to glibc through its __libc_* entry points and each request is written
+ * out in the mdriver .rep format when the program exits. Without
+ * MM_RECORD the trace goes to mm-<pid>.rep. Programs started by a
+ * recorded program inherit MM_RECORD and write <MM_RECORD>.<pid>. A
+ * program that leaves through _exit() writes its trace there, and one
+ * that execs another spills its buffers for the next program of the pid
+ * to continue. A recording with no requests writes no trace.
+ *
+ * Every block gets an id when it is allocated, a table from addresses to
+ * ids lets free and realloc name it. The table is split into stripes with
+ * a lock each. Requests are stamped with a global sequence number and
+ * collected in a buffer per thread, full buffers are appended to a spill
+ * file under a lock. At exit the spill file is sorted by sequence number,
+ * ids are renumbered in order of first use and the header is computed.
+ *
+ * A block is taken out of the table before glibc can hand its address
+ * out again, and a sequence number is drawn after the table is updated,
+ * so the order of the trace agrees with the order seen by each block.
+ * Threads still allocating while the program exits may lose the requests
+ * in their buffers, the requests of blocks that were not seen allocated
+ * are dropped from the trace.
+ *
+ * A process that dies on a signal, or execs a program that is not
+ * recorded, leaves its spill file behind with the requests of its full
+ * buffers. The first recorded process started next to it later turns
+ * such a file into the trace it would have written, once its pid is gone.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* glibc's own allocator, which the recorder wraps */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+#define STRIPES 64              /* independent parts of the id table */
+#define BUFFER_OPS 4096         /* requests buffered by each thread */
+#define NO_ID UINT32_MAX
+
+typedef enum { ALLOC, FREE, REALLOC } optype_t;
+
+/* One request as it is spilled */
+typedef struct {
+    uint64_t seq;               /* global order of the request */
+    uint64_t size;
+    uint32_t id;                /* id given by the recorder, not yet dense */
+    uint32_t type;
+} record_t;
+
+/* Open addressing table from block addresses to ids */
+typedef struct {
+    uintptr_t key;              /* 0 is empty, 1 is a deleted entry */
+    uint32_t id;
+} entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    entry_t *slots;
+    size_t cap, used;           /* used counts deleted entries too */
+} stripe_t;
+
+/* The requests of one thread not yet spilled */
+typedef struct buffer {
+    struct buffer *next;        /* all buffers, for the flush at exit */
+    int n;
+    record_t ops[BUFFER_OPS];
+} buffer_t;
+
+static stripe_t stripes[STRIPES];
+static uint64_t next_seq;
+static uint32_t next_id;
+static bool recording;          /* set once the spill file is open */
+static int spill_fd = -1;
+static char out_name[4096], spill_name[4096 + sizeof(".2147483647.spill")];
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+static buffer_t *buffers;
+static pthread_key_t buffer_key;
+
+/* Set while the recorder itself allocates, those requests are not traced */
+static __thread bool busy __attribute__((tls_model("initial-exec")));
+static __thread buffer_t *buffer __attribute__((tls_model("initial-exec")));
+
+/*
+ * stripe_of - the stripe that holds addr, blocks are at least 16 byte
+ *             aligned so the low bits are skipped
+ */
+static stripe_t *stripe_of(uintptr_t addr)
+{
+    return &stripes[(addr >> 4) * 0x9e3779b97f4a7c15ULL >> 58];
+}
+
+static size_t slot_of(const stripe_t *s, uintptr_t addr)
+{
+    return (size_t) ((addr >> 4) * 0xc2b2ae3d27d4eb4fULL >> 20) & (s->cap - 1);
+}
+
+/*
+ * grow - rehash a stripe into a table twice as big, dropping the deleted
+ *        entries. Called with the stripe locked.
+ */
+static bool grow(stripe_t *s)
+{
+    size_t old_cap = s->cap;
+    entry_t *old = s->slots;
+    size_t cap = old_cap ? 2 * old_cap : 1024;
+    entry_t *slots = __libc_calloc(cap, sizeof(entry_t));
+    if (slots == NULL)
+        return false;
+    s->slots = slots;
+    s->cap = cap;
+    s->used = 0;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key <= 1)
+            continue;
+        size_t j = slot_of(s, old[i].key);
+        while (slots[j].key != 0)
+            j = (j + 1) & (cap - 1);
+        slots[j] = old[i];
+        s->used++;
+    }
+    __libc_free(old);
+    return true;
+}
+
+static void insert_id(uintptr_t addr, uint32_t id)
+{
+    stripe_t *s = stripe_of(addr);
+    pthread_mutex_lock(&s->lock);
+    if (4 * (s->used + 1) > 3 * s->cap && !grow(s)) {
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    size_t j = slot_of(s, addr);
+    while (s->slots[j].key > 1)
+        j = (j + 1) & (s->cap - 1);
+    if (s->slots[j].key == 0)
+        s->used++;
+    s->slots[j].key = addr;
+    s->slots[j].id = id;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * remove_id - take addr out of the table and return its id, or NO_ID if
+ *             the block was allocated before recording started
+ */
+static uint32_t remove_id(uintptr_t addr)
+{
+    stripe_t *s = stripe_of(addr);
+    uint32_t id = NO_ID;
+    pthread_mutex_lock(&s->lock);
+    if (s->cap != 0) {
+        for (size_t j = slot_of(s, addr); s->slots[j].key != 0;
+             j = (j + 1) & (s->cap - 1)) {
+            if (s->slots[j].key == addr) {
+                id = s->slots[j].id;
+                s->slots[j].key = 1;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return id;
+}
+
+/*
+ * spill - append the requests of a buffer to the spill file
+ */
+static void spill(buffer_t *b)
+{
+    pthread_mutex_lock(&spill_lock);
+    size_t len = b->n * sizeof(record_t);
+    const char *p = (const char *) b->ops;
+    while (len > 0) {
+        ssize_t n = write(spill_fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        p += n;
+        len -= n;
+    }
+    b->n = 0;
+    pthread_mutex_unlock(&spill_lock);
+}
+
+/* Runs when a thread exits, its buffer stays on the list but is empty */
+static void thread_exit(void *ptr)
+{
+    spill(ptr);
+}
+
+static buffer_t *get_buffer(void)
+{
+    if (buffer == NULL) {
+        busy = true;
+        buffer_t *b = __libc_malloc(sizeof(buffer_t));
+        busy = false;
+        if (b == NULL)
+            return NULL;
+        b->n = 0;
+        pthread_mutex_lock(&spill_lock);
+        b->next = buffers;
+        buffers = b;
+        pthread_mutex_unlock(&spill_lock);
+        busy = true;
+        pthread_setspecific(buffer_key, b);
+        busy = false;
+        buffer = b;
+    }
+    return buffer;
+}
+
+/*
+ * record - stamp a request and buffer it
+ */
+static void record(optype_t type, uint32_t id, size_t size)
+{
+    buffer_t *b = get_buffer();
+    if (b == NULL)
+        return;
+    record_t *r = &b->ops[b->n++];
+    r->seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_RELAXED);
+    r->size = size;
+    r->id = id;
+    r->type = type;
+    if (b->n == BUFFER_OPS)
+        spill(b);
+}
+
+static void record_alloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return;
+    uint32_t id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    insert_id((uintptr_t) ptr, id);
+    /* mdriver replays no blocks of 0 bytes, so malloc(0) becomes malloc(1) */
+    record(ALLOC, id, size > 0 ? size : 1);
+}
+
+static bool tracing(void)
+{
+    return __atomic_load_n(&recording, __ATOMIC_ACQUIRE) && !busy;
+}
+
+void *malloc(size_t size)
+{
+    void *ptr = __libc_malloc(size);
+    if (tracing())
+        record_alloc(ptr, size);
+    return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *ptr = __libc_calloc(nmemb, size);
+    if (tracing())
+        record_alloc(ptr, nmemb * size);
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    void *ptr = __libc_memalign(alignment, size);
+    if (tracing())
+        record_alloc(ptr, size);
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+    void *ptr = memalign(alignment, size);
+    if (ptr == NULL)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL && tracing()) {
+        uint32_t id = remove_id((uintptr_t) ptr);
+        if (id != NO_ID)
+            record(FREE, id, 0);
+    }
+    __libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return malloc(size);
+    if (!tracing())
+        return __libc_realloc(ptr, size);
+
+    /* The old address may be reused as soon as glibc frees it */
+    uint32_t id = remove_id((uintptr_t) ptr);
+    void *newptr = __libc_realloc(ptr, size);
+    if (id == NO_ID) {
+        record_alloc(newptr, size);
+    } else if (newptr != NULL) {
+        insert_id((uintptr_t) newptr, id);
+        record(REALLOC, id, size);
+    } else if (size == 0) {
+        record(FREE, id, 0);
+    } else {
+        insert_id((uintptr_t) ptr, id);
+    }
+    return newptr;
+}
+
+/* The child of a fork would write into its parent's spill file */
+static void stop_child(void)
+{
+    recording = false;
+}
+
+/*
+ * flush - spill the buffers of every thread
+ */
+static void flush(void)
+{
+    pthread_mutex_lock(&spill_lock);
+    buffer_t *list = buffers;
+    pthread_mutex_unlock(&spill_lock);
+    for (buffer_t *b = list; b != NULL; b = b->next)
+        spill(b);
+}
+
+/*
+ * map_spill - map the spill file fd, storing the length of its whole
+ *             records in len and one past the largest sequence number
+ *             and id among them. Returns MAP_FAILED if it has none.
+ */
+static record_t *map_spill(int fd, size_t *len, uint64_t *seq, uint32_t *ids)
+{
+    struct stat st;
+    record_t *ops = MAP_FAILED;
+    *len = 0;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(record_t))
+        ops = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (ops == MAP_FAILED)
+        return ops;
+    /* A process killed in the middle of a write leaves part of a record */
+    size_t n = st.st_size / sizeof(record_t);
+    *len = n * sizeof(record_t);
+    for (size_t i = 0; i < n; i++) {
+        if (ops[i].seq >= *seq)
+            *seq = ops[i].seq + 1;
+        if (ops[i].id >= *ids)
+            *ids = ops[i].id + 1;
+    }
+    return ops;
+}
+
+static int by_seq(const void *a, const void *b)
+{
+    uint64_t x = ((const record_t *) a)->seq, y = ((const record_t *) b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * write_trace - sort the n spilled requests, whose ids are below ids,
+ *               and write them to name with dense ids, computing the
+ *               header first. Returns false if no trace was written.
+ */
+static bool write_trace(const char *name, record_t *ops, size_t n, uint32_t ids)
+{
+    uint32_t *dense = __libc_malloc(((size_t) ids + 1) * sizeof(uint32_t));
+    size_t *sizes = __libc_calloc((size_t) ids + 1, sizeof(size_t));
+    if (dense == NULL || sizes == NULL) {
+        fprintf(stderr, "recorder: out of memory writing %s\n", name);
+        __libc_free(dense);
+        __libc_free(sizes);
+        return false;
+    }
+    qsort(ops, n, sizeof(record_t), by_seq);
+
+    /* First pass: ids in order of first use, peak payload, requests kept */
+    memset(dense, 0xff, (size_t) ids * sizeof(uint32_t));
+    uint32_t num_ids = 0;
+    size_t num_ops = 0, live = 0, peak = 0;
+    for (size_t i = 0; i < n; i++) {
+        record_t *r = &ops[i];
+        if (r->id >= ids)
+            continue;
+        if (r->type == ALLOC)
+            dense[r->id] = num_ids++;
+        else if (dense[r->id] == NO_ID)
+            continue;
+        uint32_t d = dense[r->id];
+        live -= sizes[d];
+        sizes[d] = r->type == FREE ? 0 : r->size;
+        live += sizes[d];
+        peak = live > peak ? live : peak;
+        num_ops++;
+    }
+
+    /* mdriver takes no trace without blocks */
+    FILE *f = NULL;
+    if (num_ids == 0)
+        fprintf(stderr, "recorder: no requests recorded, %s not written\n", name);
+    else if ((f = fopen(name, "w")) == NULL)
+        fprintf(stderr, "recorder: cannot open %s: %s\n", name, strerror(errno));
+    if (f == NULL) {
+        __libc_free(dense);
+        __libc_free(sizes);
+        return false;
+    }
+
+    /* Second pass: the same requests as text */
+    fprintf(f, "1\n%u\n%zu\n%zu\n", num_ids, num_ops, peak);
+    for (size_t i = 0; i < n; i++) {
+        record_t *r = &ops[i];
+        if (r->id >= ids || dense[r->id] == NO_ID)
+            continue;
+        uint32_t d = dense[r->id];
+        if (r->type == FREE)
+            fprintf(f, "f %u\n", d);
+        else
+            fprintf(f, "%c %u %llu\n", r->type == ALLOC ? 'a' : 'r', d,
+                    (unsigned long long) r->size);
+    }
+    fclose(f);
+    __libc_free(dense);
+    __libc_free(sizes);
+    return true;
+}
+
+/*
+ * recover - write the traces of the spill files that dead processes left
+ *           in the directory of name, for those whose names start like
+ *           name, and remove the spill files
+ */
+static void recover(const char *name)
+{
+    char dir[4096], path[8192], trace[8192];
+    const char *base = strrchr(name, '/');
+    base = base == NULL ? name : base + 1;
+    snprintf(dir, sizeof(dir), "%.*s", (int) (base - name), name);
+    DIR *d = opendir(dir[0] != '\0' ? dir : ".");
+    if (d == NULL)
+        return;
+
+    struct dirent *e;
+    size_t base_len = strlen(base), suffix_len = strlen(".spill");
+    while ((e = readdir(d)) != NULL) {
+        /* <trace>.<pid>.spill */
+        size_t len = strlen(e->d_name);
+        if (len <= base_len + suffix_len || strncmp(e->d_name, base, base_len) != 0
+            || strcmp(e->d_name + len - suffix_len, ".spill") != 0)
+            continue;
+        const char *end = e->d_name + len - suffix_len, *p = end;
+        while (p > e->d_name && p[-1] >= '0' && p[-1] <= '9')
+            p--;
+        if (p == end || p - 1 <= e->d_name || p[-1] != '.')
+            continue;
+        pid_t pid = (pid_t) atoi(p);
+        if (pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+
+        snprintf(path, sizeof(path), "%s%s", dir, e->d_name);
+        snprintf(trace, sizeof(trace), "%s%.*s", dir, (int) (p - 1 - e->d_name), e->d_name);
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            continue;
+        size_t spilled;
+        uint64_t seq = 0;
+        uint32_t ids = 0;
+        record_t *ops = map_spill(fd, &spilled, &seq, &ids);
+        if (ops != MAP_FAILED) {
+            if (write_trace(trace, ops, spilled / sizeof(record_t), ids))
+                fprintf(stderr, "recorder: wrote %s from the spill file of process %d\n",
+                        trace, (int) pid);
+            munmap(ops, spilled);
+        }
+        close(fd);
+        unlink(path);
+    }
+    closedir(d);
+}
+
+__attribute__((constructor))
+static void start_recording(void)
+{
+    const char *name = getenv("MM_RECORD");
+    int pid = (int) getpid();
+    busy = true;
+
+    /* MM_RECORD_OWNER is the pid of the first program, the programs it starts add their pid */
+    const char *owner = getenv("MM_RECORD_OWNER");
+    if (name == NULL || name[0] == '\0')
+        snprintf(out_name, sizeof(out_name), "mm-%d.rep", pid);
+    else if (owner == NULL || atoi(owner) == pid)
+        snprintf(out_name, sizeof(out_name), "%s", name);
+    else
+        snprintf(out_name, sizeof(out_name), "%s.%d", name, pid);
+    if (owner == NULL) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d", pid);
+        setenv("MM_RECORD_OWNER", buf, 1);
+        recover(name == NULL || name[0] == '\0' ? "mm-" : name);
+    }
+
+    /* A spill file of this pid is continued, it was left by the program before an exec or by a dead process */
+    snprintf(spill_name, sizeof(spill_name), "%s.%d.spill", out_name, pid);
+    spill_fd = open(spill_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (spill_fd < 0 && errno == EEXIST && (spill_fd = open(spill_name, O_RDWR | O_APPEND)) >= 0) {
+        size_t spilled;
+        record_t *ops = map_spill(spill_fd, &spilled, &next_seq, &next_id);
+        if (ops != MAP_FAILED)
+            munmap(ops, spilled);
+        if (ftruncate(spill_fd, spilled) < 0)
+            fprintf(stderr, "recorder: cannot truncate %s: %s\n", spill_name, strerror(errno));
+    }
+    if (spill_fd < 0) {
+        fprintf(stderr, "recorder: cannot open %s: %s\n", spill_name, strerror(errno));
+        busy = false;
+        return;
+    }
+    for (int i = 0; i < STRIPES; i++)
+        pthread_mutex_init(&stripes[i].lock, NULL);
+    pthread_key_create(&buffer_key, thread_exit);
+    pthread_atfork(NULL, NULL, stop_child);
+    busy = false;
+    __atomic_store_n(&recording, true, __ATOMIC_RELEASE);
+}
+
+__attribute__((destructor))
+static void stop_recording(void)
+{
+    if (!__atomic_exchange_n(&recording, false, __ATOMIC_ACQ_REL))
+        return;
+    busy = true;
+    flush();
+
+    size_t spilled;
+    uint64_t seq = 0;
+    uint32_t ids = 0;
+    record_t *ops = map_spill(spill_fd, &spilled, &seq, &ids);
+    if (ops != MAP_FAILED) {
+        write_trace(out_name, ops, spilled / sizeof(record_t),
+                    __atomic_load_n(&next_id, __ATOMIC_RELAXED));
+        munmap(ops, spilled);
+    } else {
+        fprintf(stderr, "recorder: no requests recorded, %s not written\n", out_name);
+    }
+    close(spill_fd);
+    unlink(spill_name);
+}
+
+/* _exit() skips the destructors, as dash and many services leave */
+void _exit(int status)
+{
+    stop_recording();
+    void (*real)(int) = (void (*)(int)) dlsym(RTLD_NEXT, "_exit");
+    real(status);
+    __builtin_unreachable();
+}
+
+void _Exit(int status)
+{
+    _exit(status);
+}
+
+/*
+ * before_exec - spill every buffer for the program that replaces this
+ *               one, which continues the spill file. If the exec fails
+ *               the recording goes on.
+ */
+static void before_exec(void)
+{
+    if (!tracing())
+        return;
+    busy = true;
+    flush();
+    busy = false;
+}
+
+typedef int (*exec_t)(const char *, char *const [], char *const []);
+
+int execve(const char *path, char *const argv[], char *const envp[])
+{
+    before_exec();
+    return ((exec_t) dlsym(RTLD_NEXT, "execve"))(path, argv, envp);
+}
+
+int execvpe(const char *file, char *const argv[], char *const envp[])
+{
+    before_exec();
+    return ((exec_t) dlsym(RTLD_NEXT, "execvpe"))(file, argv, envp);
+}
+
+int execv(const char *path, char *const argv[])
+{
+    return execve(path, argv, environ);
+}
+
+int execvp(const char *file, char *const argv[])
+{
+    return execvpe(file, argv, environ);
+}
+
+int fexecve(int fd, char *const argv[], char *const envp[])
+{
+    before_exec();
+    int (*real)(int, char *const [], char *const []) =
+        (int (*)(int, char *const [], char *const [])) dlsym(RTLD_NEXT, "fexecve");
+    return real(fd, argv, envp);
+}
@@ -0,0 +1,158 @@
+/*
+ * rep2bin - convert a .rep trace to the binary trace format of trace.h
+ *
+ * usage: rep2bin <in.rep> <out>
+ *
+ * The requests are checked here once, so the driver can map the output
+ * without looking at them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+static const char *out_name;    /* removed on a failed write if it is a regular file */
+static bool out_regular;
+
+static void fail(const char *name, long line, const char *msg)
+{
+    fprintf(stderr, "rep2bin: %s:%ld: %s\n", name, line, msg);
+    exit(1);
+}
+
+/* Report a failed system call like the driver does, leaving no partial output behind */
+static void unix_error(const char *fmt, ...)
+{
+    va_list ap;
+    int err = errno;
+    va_start(ap, fmt);
+    fprintf(stderr, "rep2bin: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, ": %s\n", strerror(err));
+    va_end(ap);
+    if (out_regular)
+        unlink(out_name);
+    exit(1);
+}
+
+static void put(const void *p, size_t size, FILE *out)
+{
+    if (fwrite(p, size, 1, out) != 1)
+        unix_error("%s", out_name);
+}
+
+int main(int argc, char *argv[])
+{
+    trace_header_t hdr;
+    traceop_t op;
+    char type[2];
+    long num_ops, line, epoch = 0;
+    int weight, num_ids, max_index = -1;
+    unsigned long index, count;
+    long free_index;
+    size_t size;
+    FILE *in, *out;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <in.rep> <out>\n", argv[0]);
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+        unix_error("%s", argv[1]);
+    if ((out = fopen(argv[2], "w")) == NULL)
+        unix_error("%s", argv[2]);
+    struct stat st;
+    out_name = argv[2];
+    out_regular = fstat(fileno(out), &st) == 0 && S_ISREG(st.st_mode);
+
+    /* The four header lines */
+    memset(&hdr, 0, sizeof(hdr));
+    if (fscanf(in, "%d %d %ld %zu", &weight, &num_ids, &num_ops, &size) != 4
+        || num_ids < 0 || num_ops < 0)
+        fail(argv[1], 1, "bad header");
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.weight = weight;
+    hdr.num_ids = num_ids;
+    hdr.num_ops = num_ops;
+    hdr.data_bytes = size;
+    put(&hdr, sizeof(hdr), out);
+
+    /* One record per request line */
+    memset(&op, 0, sizeof(op));
+    for (line = 5; line < num_ops + 5; line++) {
+        if (fscanf(in, "%1s", type) != 1)
+            fail(argv[1], line, "fewer requests than the header says");
+        switch (type[0]) {
+            case 'a':
+            case 'r':
+            case 'n':
+                if (fscanf(in, "%lu %zu", &index, &size) != 2)
+                    fail(argv[1], line, "expected an index and a size");
+                op.type = type[0] == 'a' ? ALLOC : type[0] == 'r' ? REALLOC : ARENA_ALLOC;
+                op.size = size;
+                break;
+            case 'f':
+                if (fscanf(in, "%ld", &free_index) != 1)
+                    fail(argv[1], line, "expected an index");
+                op.type = FREE;
+                op.size = 0;
+                /* Index -1 is free(NULL), which names no id */
+                if (free_index == -1) {
+                    op.count = 0;
+                    op.index = -1;
+                    put(&op, sizeof(op), out);
+                    continue;
+                }
+                index = free_index < 0 ? (unsigned long) num_ids : (unsigned long) free_index;
+                break;
+            case 'A':
+                if (fscanf(in, "%lu %lu %zu", &index, &count, &size) != 3)
+                    fail(argv[1], line, "expected an index, a count and a size");
+                op.type = ALLOC_BATCH;
+                op.size = size;
+                break;
+            case 'F':
+                if (fscanf(in, "%lu %lu", &index, &count) != 2)
+                    fail(argv[1], line, "expected an index and a count");
+                op.type = FREE_BATCH;
+                op.size = 0;
+                break;
+            case 'N':
+                /* A reset points back at the first request since the last one */
+                op.type = ARENA_RESET;
+                op.count = 0;
+                op.index = epoch;
+                op.size = 0;
+                epoch = line - 4;
+                put(&op, sizeof(op), out);
+                continue;
+            default:
+                fail(argv[1], line, "bogus request type");
+        }
+        /* A batch uses the ids index..index+count-1 */
+        if (type[0] != 'A' && type[0] != 'F')
+            count = 1;
+        else if (count == 0)
+            fail(argv[1], line, "empty batch");
+        if (index >= (unsigned long) num_ids || count > num_ids - index)
+            fail(argv[1], line, "index beyond the number of ids");
+        op.count = type[0] == 'A' || type[0] == 'F' ? (int32_t) count : 0;
+        if ((int) (index + count - 1) > max_index)
+            max_index = (int) (index + count - 1);
+        op.index = (long) index;
+        put(&op, sizeof(op), out);
+    }
+    if (max_index != num_ids - 1)
+        fail(argv[1], line, "the header counts ids that are never used");
+
+    if (fclose(out) != 0)
+        unix_error("%s", argv[2]);
+    fclose(in);
+    return 0;
+}
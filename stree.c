@@ -27,6 +27,7 @@ tree_t *tree_new() {
 	exit(1);
     }
     tree->root = NULL;
+    tree->spare = NULL;
     tree->node_count = 0;
     tree->comparison_count = 0;
     return tree;
@@ -35,6 +36,11 @@ tree_t *tree_new() {
 void tree_free(tree_t *tree, free_fun_t free_fun) {
     if (tree->root)
 	free_subtree(tree->root, free_fun);
+    while (tree->spare) {
+	node_t *z = tree->spare;
+	tree->spare = z->right;
+	free(z);
+    }
     free(tree);
 }
 
@@ -55,8 +61,10 @@ bool tree_insert(tree_t *tree, tkey_t key, void *record) {
 	    z = z->left;
     }
     
-    z = malloc(sizeof(node_t));
-    if (!z) {
+    if (tree->spare) {
+	z = tree->spare;
+	tree->spare = z->right;
+    } else if (!(z = malloc(sizeof(node_t)))) {
 	fprintf(stderr, "ERROR.  Couldn't create range tree node\n");
 	exit(1);
     }
@@ -135,7 +143,8 @@ void *tree_remove(tree_t *tree, tkey_t key) {
     }
     r = z->record;
     tree->node_count--;
-    free(z);
+    z->right = tree->spare;
+    tree->spare = z;
     return r;
 }
 
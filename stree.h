@@ -19,6 +19,7 @@ typedef struct node {
     
 typedef struct {
     node_t *root;
+    node_t *spare;  // removed nodes, reused by later insertions
     size_t node_count;
     size_t comparison_count;
 } tree_t;
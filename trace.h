@@ -0,0 +1,34 @@
+/*
+ * Binary trace format, shared by mdriver and rep2bin
+ *
+ * A binary trace is a trace_header_t followed by num_ops traceop_t
+ * records, written in the byte order and struct layout of the machine
+ * that made it. The driver maps the file and uses the records in place,
+ * so loading does not depend on the size of the trace.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_MAGIC "mmtrace1"      /* 8 bytes, without the terminator */
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum { ALLOC, FREE, REALLOC, ALLOC_BATCH, FREE_BATCH,
+           ARENA_ALLOC, ARENA_RESET } type; /* type of request */
+    int32_t count;                      /* a batch covers ids index..index+count-1 */
+    long index;                         /* index for free() to use later, for a reset
+                                           the first request since the last reset */
+    size_t size;                        /* byte size of alloc/realloc request */
+} traceop_t;
+
+#define NUM_OP_TYPES 7
+
+/* Same fields as the four header lines of a .rep file */
+typedef struct {
+    char magic[8];
+    int32_t weight;
+    int32_t num_ids;
+    uint64_t num_ops;
+    uint64_t data_bytes;
+    uint64_t reserved[4];           /* keeps the records 64 byte aligned */
+} trace_header_t;